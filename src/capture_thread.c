@@ -0,0 +1,251 @@
+#include "capture_thread.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Both lists are pushed to by one thread and emptied all at once by the
+ * other, so there's no ABA to worry about. */
+static void push(_Atomic(struct capture_item *) *list,
+                 struct capture_item *item) {
+  struct capture_item *head = atomic_load_explicit(list, memory_order_relaxed);
+  do {
+    item->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      list, &head, item, memory_order_release, memory_order_relaxed));
+}
+
+/* Takes everything pushed so far, oldest first. */
+static struct capture_item *take_all(_Atomic(struct capture_item *) *list) {
+  struct capture_item *item =
+      atomic_exchange_explicit(list, NULL, memory_order_acquire);
+  struct capture_item *reversed = NULL;
+  while (item != NULL) {
+    struct capture_item *next = item->next;
+    item->next = reversed;
+    reversed = item;
+    item = next;
+  }
+  return reversed;
+}
+
+static void signal_fd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    log_error("Failed to signal capture thread eventfd: %s\n",
+              strerror(errno));
+  }
+}
+
+static void drain_fd(int fd) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_error("Failed to read capture thread eventfd: %s\n", strerror(errno));
+  }
+}
+
+static void start_item(struct capture_thread *capture_thread,
+                       struct capture_item *item) {
+  wl_list_insert(capture_thread->in_flight.prev, &item->link);
+  item->start(item);
+}
+
+static void start_submitted(struct capture_thread *capture_thread) {
+  struct capture_item *item = take_all(&capture_thread->submitted);
+  while (item != NULL) {
+    struct capture_item *next = item->next;
+    start_item(capture_thread, item);
+    item = next;
+  }
+}
+
+/* The same dance as event_loop_dispatch(), but for our own queue. libwayland
+ * lets both threads read from the display, and sorts the events into the
+ * queue they belong to. */
+static void *capture_thread_main(void *data) {
+  struct capture_thread *capture_thread = data;
+  struct wl_display *wl_display = capture_thread->wl_display;
+  struct wl_event_queue *queue = capture_thread->queue;
+
+  while (!atomic_load(&capture_thread->stopping)) {
+    start_submitted(capture_thread);
+
+    while (wl_display_prepare_read_queue(wl_display, queue) != 0) {
+      if (wl_display_dispatch_queue_pending(wl_display, queue) < 0) {
+        return NULL;
+      }
+    }
+    /* Send the copy requests now rather than whenever the main thread gets
+     * around to flushing. */
+    if (wl_display_flush(wl_display) < 0 && errno != EAGAIN) {
+      wl_display_cancel_read(wl_display);
+      return NULL;
+    }
+
+    struct pollfd pollfds[2] = {
+        {.fd = wl_display_get_fd(wl_display), .events = POLLIN},
+        {.fd = capture_thread->wake_fd, .events = POLLIN},
+    };
+    if (poll(pollfds, 2, -1) < 0) {
+      wl_display_cancel_read(wl_display);
+      if (errno == EINTR) {
+        continue;
+      }
+      return NULL;
+    }
+
+    if (pollfds[0].revents & POLLIN) {
+      if (wl_display_read_events(wl_display) < 0) {
+        return NULL;
+      }
+    } else {
+      wl_display_cancel_read(wl_display);
+    }
+    if (pollfds[1].revents & POLLIN) {
+      drain_fd(capture_thread->wake_fd);
+    }
+
+    if (wl_display_dispatch_queue_pending(wl_display, queue) < 0) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/* Runs `done` for everything the capture thread has finished so far. */
+static void handle_finished_captures(void *data, int fd, uint32_t revents) {
+  struct capture_thread *capture_thread = data;
+  drain_fd(fd);
+
+  struct capture_item *item = take_all(&capture_thread->finished);
+  while (item != NULL) {
+    struct capture_item *next = item->next;
+    item->done(item);
+    item = next;
+  }
+}
+
+bool capture_thread_init(struct capture_thread *capture_thread,
+                         struct event_loop *loop,
+                         struct wl_display *wl_display) {
+  memset(capture_thread, 0, sizeof(struct capture_thread));
+  capture_thread->wl_display = wl_display;
+  wl_list_init(&capture_thread->in_flight);
+  capture_thread->wake_fd = -1;
+  capture_thread->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (capture_thread->done_fd < 0) {
+    log_error("Failed to create capture thread eventfd: %s\n",
+              strerror(errno));
+    return false;
+  }
+  if (!event_loop_add_fd(loop, capture_thread->done_fd, POLLIN,
+                         handle_finished_captures, capture_thread)) {
+    return false;
+  }
+  capture_thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (capture_thread->wake_fd < 0) {
+    log_error("Failed to create capture thread eventfd: %s\n",
+              strerror(errno));
+    return false;
+  }
+
+  capture_thread->queue = wl_display_create_queue(wl_display);
+  if (capture_thread->queue == NULL) {
+    log_error("Failed to create capture event queue\n");
+    return false;
+  }
+
+  /* Signals are for the main thread, see worker_pool_init(). */
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  capture_thread->running =
+      pthread_create(&capture_thread->thread, NULL, capture_thread_main,
+                     capture_thread) == 0;
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  if (!capture_thread->running) {
+    log_error("Failed to create capture thread\n");
+    wl_event_queue_destroy(capture_thread->queue);
+    capture_thread->queue = NULL;
+    return false;
+  }
+  return true;
+}
+
+void *capture_thread_wrap(struct capture_thread *capture_thread, void *proxy) {
+  struct wl_proxy *wrapper = wl_proxy_create_wrapper(proxy);
+  if (wrapper != NULL && capture_thread->running) {
+    wl_proxy_set_queue(wrapper, capture_thread->queue);
+  }
+  return wrapper;
+}
+
+void capture_thread_submit(struct capture_thread *capture_thread,
+                           struct capture_item *item, capture_item_cb start,
+                           capture_item_cb done) {
+  item->start = start;
+  item->done = done;
+  item->cancelled = false;
+
+  if (!capture_thread->running) {
+    start_item(capture_thread, item);
+    return;
+  }
+  push(&capture_thread->submitted, item);
+  signal_fd(capture_thread->wake_fd);
+}
+
+void capture_thread_finish(struct capture_thread *capture_thread,
+                           struct capture_item *item) {
+  wl_list_remove(&item->link);
+  if (!capture_thread->running) {
+    item->done(item);
+    return;
+  }
+  push(&capture_thread->finished, item);
+  signal_fd(capture_thread->done_fd);
+}
+
+void capture_thread_destroy(struct capture_thread *capture_thread) {
+  if (capture_thread->running) {
+    atomic_store(&capture_thread->stopping, true);
+    signal_fd(capture_thread->wake_fd);
+    pthread_join(capture_thread->thread, NULL);
+    capture_thread->running = false;
+  }
+
+  /* The thread is gone, so whatever it left behind is ours now. */
+  struct capture_item *item = take_all(&capture_thread->finished);
+  struct capture_item *next;
+  for (; item != NULL; item = next) {
+    next = item->next;
+    item->cancelled = true;
+    item->done(item);
+  }
+  struct capture_item *tmp;
+  wl_list_for_each_safe(item, tmp, &capture_thread->in_flight, link) {
+    wl_list_remove(&item->link);
+    item->cancelled = true;
+    item->done(item);
+  }
+  for (item = take_all(&capture_thread->submitted); item != NULL;
+       item = next) {
+    next = item->next;
+    item->cancelled = true;
+    item->done(item);
+  }
+
+  if (capture_thread->queue != NULL) {
+    wl_event_queue_destroy(capture_thread->queue);
+  }
+  if (capture_thread->wake_fd >= 0) {
+    close(capture_thread->wake_fd);
+  }
+  if (capture_thread->done_fd >= 0) {
+    close(capture_thread->done_fd);
+  }
+}
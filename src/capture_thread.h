@@ -0,0 +1,75 @@
+#ifndef _CAPTURE_THREAD_H_
+#define _CAPTURE_THREAD_H_
+
+#include "event_loop.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <wayland-client.h>
+
+/* A thread with a Wayland event queue of its own, for captures. Setting up,
+ * copying and converting a capture is a handful of roundtrips and a pass over
+ * every pixel, and none of it should keep key presses or frame callbacks
+ * waiting on the main thread. Captures are handed over in both directions
+ * through lock-free lists, and the main thread is woken up through the event
+ * loop once some are finished. */
+
+struct capture_item;
+typedef void (*capture_item_cb)(struct capture_item *item);
+
+/* Meant to be embedded in a bigger struct describing the actual capture. */
+struct capture_item {
+  /* In the submitted or finished list. */
+  struct capture_item *next;
+  /* In the in-flight list, on the capture thread. */
+  struct wl_list      link;
+  /* Called on the capture thread. Should make the requests whose events
+   * eventually lead to capture_thread_finish(). */
+  capture_item_cb     start;
+  /* Called on the main thread once finished, or without finishing if the
+   * thread is torn down first, with `cancelled` set. Should free the item. */
+  capture_item_cb     done;
+  bool                cancelled;
+};
+
+struct capture_thread {
+  struct wl_display                *wl_display;
+  struct wl_event_queue            *queue;
+  pthread_t                        thread;
+  /* Without a thread, items are started and finished right away on the main
+   * thread, and their events dispatched on the default queue. */
+  bool                             running;
+  atomic_bool                      stopping;
+
+  _Atomic(struct capture_item *)   submitted;
+  _Atomic(struct capture_item *)   finished;
+  /* Only touched by the capture thread. */
+  struct wl_list                   in_flight;
+
+  /* Signalled when something is submitted, or to stop. */
+  int                              wake_fd;
+  /* Signalled whenever an item lands in `finished`. */
+  int                              done_fd;
+};
+
+bool capture_thread_init(struct capture_thread *capture_thread,
+                         struct event_loop *loop,
+                         struct wl_display *wl_display);
+
+/* A wrapper of `proxy` whose new objects get their events dispatched on the
+ * capture thread. Destroy it with wl_proxy_wrapper_destroy(). */
+void *capture_thread_wrap(struct capture_thread *capture_thread, void *proxy);
+
+void capture_thread_submit(struct capture_thread *capture_thread,
+                           struct capture_item *item, capture_item_cb start,
+                           capture_item_cb done);
+
+/* Called on the capture thread, from an event handler, once the capture
+ * needs no more events. */
+void capture_thread_finish(struct capture_thread *capture_thread,
+                           struct capture_item *item);
+
+/* Stops the thread, then calls `done` for every item left. */
+void capture_thread_destroy(struct capture_thread *capture_thread);
+
+#endif /* _CAPTURE_THREAD_H_ */
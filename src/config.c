@@ -56,6 +56,11 @@ struct config_shortcut_extended {
 struct config_extended {
   char *font;
   uint32_t font_size;
+  char *first_frame_deadline_ms;
+  char *scaled_cache_size_mb;
+  char *frame_budget_ms;
+  char *max_surface_buffers;
+  bool subsurface_previews;
   enum client_filter_behavior client_filter_behavior;
   struct config_peekaboo_extended peekaboo;
   struct config_preview_extended preview;
@@ -184,6 +189,23 @@ static const cyaml_schema_field_t yaml_config_fields_schema[] = {
                            CONFIG_FIELD_MAX_LEN),
     CYAML_FIELD_UINT("font_size", CYAML_FLAG_OPTIONAL, struct config_extended,
                      font_size),
+    CYAML_FIELD_STRING_PTR(
+        "first_frame_deadline_ms", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct config_extended, first_frame_deadline_ms, 0,
+        CONFIG_FIELD_MAX_LEN),
+    CYAML_FIELD_STRING_PTR(
+        "scaled_cache_size_mb", CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+        struct config_extended, scaled_cache_size_mb, 0, CONFIG_FIELD_MAX_LEN),
+    CYAML_FIELD_STRING_PTR("frame_budget_ms",
+                           CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+                           struct config_extended, frame_budget_ms, 0,
+                           CONFIG_FIELD_MAX_LEN),
+    CYAML_FIELD_STRING_PTR("max_surface_buffers",
+                           CYAML_FLAG_POINTER | CYAML_FLAG_OPTIONAL,
+                           struct config_extended, max_surface_buffers, 0,
+                           CONFIG_FIELD_MAX_LEN),
+    CYAML_FIELD_BOOL("subsurface_previews", CYAML_FLAG_OPTIONAL,
+                     struct config_extended, subsurface_previews),
     CYAML_FIELD_MAPPING("peekaboo", CYAML_FLAG_OPTIONAL, struct config_extended,
                         peekaboo, peekaboo_schema),
     CYAML_FIELD_MAPPING("preview", CYAML_FLAG_OPTIONAL, struct config_extended,
@@ -346,6 +368,26 @@ bool config_extended_load(struct config *config,
   if (config_extended->font_size != 0) {
     config->font_size = MAX(config_extended->font_size, 4);
   }
+  if (config_extended->first_frame_deadline_ms != NULL) {
+    config->first_frame_deadline_ms =
+        strtoul(config_extended->first_frame_deadline_ms, NULL, 0);
+  }
+  if (config_extended->scaled_cache_size_mb != NULL) {
+    /* Just a floor against evicting on every insert. Thumbnails filling a
+     * 4K output take about 33MB, and a budget below a screenful keeps
+     * evicting what's being drawn. */
+    config->scaled_cache_size_mb =
+        MAX(strtoul(config_extended->scaled_cache_size_mb, NULL, 0), 16);
+  }
+  if (config_extended->frame_budget_ms != NULL) {
+    config->frame_budget_ms =
+        strtoul(config_extended->frame_budget_ms, NULL, 0);
+  }
+  if (config_extended->max_surface_buffers != NULL) {
+    config->max_surface_buffers =
+        strtoul(config_extended->max_surface_buffers, NULL, 0);
+  }
+  config->subsurface_previews = config_extended->subsurface_previews;
   config->client_filter_behavior = config_extended->client_filter_behavior;
   bool failed =
       !element_style_extended_load(&config->peekaboo.style,
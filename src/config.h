@@ -15,6 +15,22 @@ struct config {
   enum client_filter_behavior client_filter_behavior;
   char                        font[CONFIG_FIELD_MAX_LEN];
   int32_t                     font_size;
+  /* How long after the surface is configured we wait for captures before
+   * painting the first frame with placeholders. */
+  int32_t                     first_frame_deadline_ms;
+  /* Memory all scaled previews together may take up before the least
+   * recently used ones are thrown out. */
+  int32_t                     scaled_cache_size_mb;
+  /* How long a frame may spend scaling previews on the main thread before
+   * settling for rough ones and finishing them in the next frame. 0 means
+   * no limit. */
+  int32_t                     frame_budget_ms;
+  /* How many buffers we may draw frames into while the compositor still
+   * holds on to the previous ones. */
+  int32_t                     max_surface_buffers;
+  /* Give every preview its own subsurface with the capture attached as is,
+   * and have the compositor scale it, instead of scaling it ourselves. */
+  bool                        subsurface_previews;
   struct                      {
     struct element_style      style;
   }                           peekaboo;
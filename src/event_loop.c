@@ -0,0 +1,150 @@
+#include "event_loop.h"
+#include "log.h"
+#include "util.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+
+void event_loop_init(struct event_loop *loop, struct wl_display *wl_display) {
+  memset(loop, 0, sizeof(struct event_loop));
+  loop->wl_display = wl_display;
+  wl_list_init(&loop->timers);
+}
+
+bool event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+                       event_loop_fd_cb cb, void *data) {
+  if (loop->num_fds == EVENT_LOOP_MAX_FDS) {
+    log_error("Too many file descriptors in event loop.\n");
+    return false;
+  }
+  loop->fds[loop->num_fds++] = (struct event_loop_fd){
+      .fd = fd,
+      .events = events,
+      .cb = cb,
+      .data = data,
+  };
+  return true;
+}
+
+void event_loop_timer_init(struct event_loop_timer *timer,
+                           event_loop_timer_cb cb, void *data) {
+  memset(timer, 0, sizeof(struct event_loop_timer));
+  wl_list_init(&timer->link);
+  timer->cb = cb;
+  timer->data = data;
+}
+
+/* Deadlines are in the wrapping millisecond clock of gettime_ms(), so compare
+ * them through a signed difference. */
+static int32_t ms_until(uint32_t deadline_ms, uint32_t now_ms) {
+  return (int32_t)(deadline_ms - now_ms);
+}
+
+void event_loop_timer_arm(struct event_loop *loop,
+                          struct event_loop_timer *timer, uint32_t delay_ms) {
+  event_loop_timer_disarm(timer);
+  timer->deadline_ms = gettime_ms() + delay_ms;
+  timer->armed = true;
+
+  /* Keep the list sorted by deadline so the head is always next to fire. */
+  struct event_loop_timer *other;
+  wl_list_for_each(other, &loop->timers, link) {
+    if (ms_until(timer->deadline_ms, other->deadline_ms) < 0) {
+      wl_list_insert(other->link.prev, &timer->link);
+      return;
+    }
+  }
+  wl_list_insert(loop->timers.prev, &timer->link);
+}
+
+void event_loop_timer_disarm(struct event_loop_timer *timer) {
+  if (timer->armed) {
+    wl_list_remove(&timer->link);
+    wl_list_init(&timer->link);
+    timer->armed = false;
+  }
+}
+
+static int next_timeout_ms(struct event_loop *loop) {
+  if (wl_list_empty(&loop->timers)) {
+    return -1;
+  }
+  struct event_loop_timer *timer =
+      wl_container_of(loop->timers.next, timer, link);
+  int32_t timeout = ms_until(timer->deadline_ms, gettime_ms());
+  return timeout < 0 ? 0 : timeout;
+}
+
+static void run_expired_timers(struct event_loop *loop) {
+  uint32_t now_ms = gettime_ms();
+  while (!wl_list_empty(&loop->timers)) {
+    struct event_loop_timer *timer =
+        wl_container_of(loop->timers.next, timer, link);
+    if (ms_until(timer->deadline_ms, now_ms) > 0) {
+      break;
+    }
+    /* Disarm first so the callback is free to re-arm the timer. */
+    event_loop_timer_disarm(timer);
+    timer->cb(timer->data);
+  }
+}
+
+int event_loop_dispatch(struct event_loop *loop) {
+  struct wl_display *wl_display = loop->wl_display;
+
+  while (wl_display_prepare_read(wl_display) != 0) {
+    if (wl_display_dispatch_pending(wl_display) < 0) {
+      return -1;
+    }
+  }
+
+  if (wl_display_flush(wl_display) < 0 && errno != EAGAIN) {
+    wl_display_cancel_read(wl_display);
+    return -1;
+  }
+
+  struct pollfd pollfds[EVENT_LOOP_MAX_FDS + 1];
+  pollfds[0] = (struct pollfd){
+      .fd = wl_display_get_fd(wl_display),
+      .events = POLLIN,
+  };
+  for (uint32_t i = 0; i < loop->num_fds; i++) {
+    pollfds[i + 1] = (struct pollfd){
+        .fd = loop->fds[i].fd,
+        .events = loop->fds[i].events,
+    };
+  }
+
+  int ret = poll(pollfds, loop->num_fds + 1, next_timeout_ms(loop));
+  if (ret < 0) {
+    wl_display_cancel_read(wl_display);
+    /* Signals are fine, we just go around again. */
+    return errno == EINTR ? 0 : -1;
+  }
+
+  if (pollfds[0].revents & POLLIN) {
+    if (wl_display_read_events(wl_display) < 0) {
+      return -1;
+    }
+  } else {
+    wl_display_cancel_read(wl_display);
+  }
+  if (pollfds[0].revents & (POLLERR | POLLHUP)) {
+    return -1;
+  }
+
+  if (wl_display_dispatch_pending(wl_display) < 0) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < loop->num_fds; i++) {
+    if (pollfds[i + 1].revents != 0) {
+      loop->fds[i].cb(loop->fds[i].data, loop->fds[i].fd,
+                      pollfds[i + 1].revents);
+    }
+  }
+
+  run_expired_timers(loop);
+
+  return 0;
+}
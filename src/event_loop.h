@@ -0,0 +1,59 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+/* A small poll()-based loop around the Wayland display. On top of dispatching
+ * Wayland events, it lets us wait on timers (deadlines, retries) and other
+ * file descriptors without blocking on whichever is slowest. */
+
+#define EVENT_LOOP_MAX_FDS 8
+
+typedef void (*event_loop_timer_cb)(void *data);
+typedef void (*event_loop_fd_cb)(void *data, int fd, uint32_t revents);
+
+/* Timers are meant to be embedded in whatever owns them. */
+struct event_loop_timer {
+  struct wl_list      link;
+  bool                armed;
+  uint32_t            deadline_ms;
+  event_loop_timer_cb cb;
+  void                *data;
+};
+
+struct event_loop_fd {
+  int              fd;
+  uint32_t         events;
+  event_loop_fd_cb cb;
+  void             *data;
+};
+
+struct event_loop {
+  struct wl_display    *wl_display;
+  struct wl_list       timers;
+  struct event_loop_fd fds[EVENT_LOOP_MAX_FDS];
+  uint32_t             num_fds;
+};
+
+void event_loop_init(struct event_loop *loop, struct wl_display *wl_display);
+
+/* Watches `fd` for the given poll() events. */
+bool event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events,
+                       event_loop_fd_cb cb, void *data);
+
+void event_loop_timer_init(struct event_loop_timer *timer,
+                           event_loop_timer_cb cb, void *data);
+
+/* (Re-)arms the timer to fire once, `delay_ms` from now. */
+void event_loop_timer_arm(struct event_loop *loop,
+                          struct event_loop_timer *timer, uint32_t delay_ms);
+
+void event_loop_timer_disarm(struct event_loop_timer *timer);
+
+/* Waits for and dispatches one batch of events. Returns -1 if the connection
+ * to the compositor broke. */
+int event_loop_dispatch(struct event_loop *loop);
+
+#endif /* _EVENT_LOOP_H_ */
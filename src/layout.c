@@ -24,12 +24,10 @@ struct layout *layout_init() {
  * These conditions should restrain us to a single layout.
  */
 struct layout *calculate_layout_fixed_individual_aspect_ratio(
-    uint32_t num_previews, double surface_width, double surface_height) {
-  double surface_aspect_ratio = surface_width / surface_height;
+    uint32_t num_previews, uint32_t surface_width, uint32_t surface_height) {
+  double surface_aspect_ratio = (double)surface_width / surface_height;
 
   uint32_t best_num_cols = 1;
-  double best_rect_width = 0;
-  double best_rect_height = 0;
   double best_bounding_aspect_ratio_diff = 10e12;
 
   for (uint32_t num_cols = 1; num_cols < num_previews + 1; num_cols++) {
@@ -44,8 +42,6 @@ struct layout *calculate_layout_fixed_individual_aspect_ratio(
     if (bounding_aspect_ratio_diff < best_bounding_aspect_ratio_diff &&
         num_cols * num_rows >= num_previews) {
       best_num_cols = num_cols;
-      best_rect_width = rect_width;
-      best_rect_height = rect_height;
       best_bounding_aspect_ratio_diff = bounding_aspect_ratio_diff;
     }
   }
@@ -57,16 +53,20 @@ struct layout *calculate_layout_fixed_individual_aspect_ratio(
   layout->num_cols = best_num_cols;
   layout->num_rows = best_num_rows;
   struct rect preview_geometry;
-  double bounding_height = best_num_rows * best_rect_height;
-  // Used for centering.
-  double y_offset = (surface_height - bounding_height) / 2.0;
+  // Every rect gets the same whole number of pixels, and the few left over
+  // go to centering.
+  int32_t rect_width = surface_width / best_num_cols;
+  int32_t rect_height = surface_height / best_num_cols;
+  int32_t x_offset = (surface_width - best_num_cols * rect_width) / 2;
+  int32_t y_offset = ((int32_t)surface_height -
+                      (int32_t)best_num_rows * rect_height) /
+                     2;
 
   for (uint32_t i = 0; i < num_previews; i++) {
-    preview_geometry.x = (i % best_num_cols) * best_rect_width;
-    preview_geometry.y =
-        (floor((double)i / best_num_cols) * best_rect_height) + y_offset;
-    preview_geometry.width = best_rect_width;
-    preview_geometry.height = best_rect_height;
+    preview_geometry.x = (int32_t)(i % best_num_cols) * rect_width + x_offset;
+    preview_geometry.y = (int32_t)(i / best_num_cols) * rect_height + y_offset;
+    preview_geometry.width = rect_width;
+    preview_geometry.height = rect_height;
     vec_append(layout->preview_geometries, &preview_geometry);
   }
 
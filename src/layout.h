@@ -7,9 +7,11 @@
  * go and the dimensions they should be assigned, given a number of previews
  * we need to show. */
 
+/* In device pixels. Keeping everything on whole pixels means surfaces of the
+ * right size are composited as plain copies, not resampled. */
 struct rect {
-  double x, y;
-  double width, height;
+  int32_t x, y;
+  int32_t width, height;
 };
 
 struct layout {
@@ -27,7 +29,7 @@ struct layout {
  *   on the surface
  */
 struct layout *calculate_layout_fixed_individual_aspect_ratio(
-    uint32_t num_previews, double surface_width, double surface_height);
+    uint32_t num_previews, uint32_t surface_width, uint32_t surface_height);
 
 void layout_destroy(struct layout *layout);
 
@@ -1,12 +1,15 @@
 #include "config.h"
+#include "event_loop.h"
 #include "log.h"
 #include "peekaboo.h"
 #include "preview.h"
 #include "styles.h"
 #include "string.h"
 #include "surface.h"
+#include "telemetry.h"
 #include "util.h"
 #include "wm_client/wm_client.h"
+#include "worker_pool.h"
 #include <fractional-scale-v1.h>
 #include <getopt.h>
 #include <hyprland-toplevel-export-v1.h>
@@ -39,8 +42,11 @@ uint32_t launch_time_ms = 0;
 
 static void noop(void) {}
 const struct wl_callback_listener surface_callback_listener;
+static void request_frame(struct peekaboo *peekaboo);
 
-static void send_frame(struct peekaboo *peekaboo) {
+/* The size of our surface in buffer pixels. */
+static void get_buffer_size(struct peekaboo *peekaboo, uint32_t *width,
+                            uint32_t *height) {
   int32_t scale_120 = peekaboo->fractional_scale;
   if (scale_120 == 0) {
     // Falling back to the output scale if fractional scale is not received.
@@ -50,10 +56,47 @@ static void send_frame(struct peekaboo *peekaboo) {
         120;
   }
 
-  struct surface_buffer *surface_buffer = get_next_buffer(
-      &peekaboo->config, peekaboo->wl_shm, &peekaboo->surface_buffer_pool,
-      peekaboo->surface_width * scale_120 / 120,
-      peekaboo->surface_height * scale_120 / 120);
+  *width = peekaboo->surface_width * scale_120 / 120;
+  *height = peekaboo->surface_height * scale_120 / 120;
+}
+
+/* Tells the compositor what it doesn't have to blend us with, or draw under
+ * us at all. The scene's opaque region is in buffer pixels and the surface's
+ * in surface coordinates, so it's rounded inwards on the way. */
+static void set_opaque_region(struct peekaboo *peekaboo, uint32_t buffer_width,
+                              uint32_t buffer_height) {
+  struct wl_region *wl_region =
+      wl_compositor_create_region(peekaboo->wl_compositor);
+  cairo_region_t *opaque = peekaboo->scene.opaque;
+  for (int i = 0; i < cairo_region_num_rectangles(opaque); i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(opaque, i, &rect);
+    int64_t x0 =
+        ((int64_t)rect.x * peekaboo->surface_width + buffer_width - 1) /
+        buffer_width;
+    int64_t y0 =
+        ((int64_t)rect.y * peekaboo->surface_height + buffer_height - 1) /
+        buffer_height;
+    int64_t x1 =
+        (int64_t)(rect.x + rect.width) * peekaboo->surface_width / buffer_width;
+    int64_t y1 = (int64_t)(rect.y + rect.height) * peekaboo->surface_height /
+                 buffer_height;
+    if (x1 > x0 && y1 > y0) {
+      wl_region_add(wl_region, x0, y0, x1 - x0, y1 - y0);
+    }
+  }
+  wl_surface_set_opaque_region(peekaboo->wl_surface, wl_region);
+  wl_region_destroy(wl_region);
+}
+
+static void send_frame(struct peekaboo *peekaboo) {
+  uint32_t buffer_width, buffer_height;
+  get_buffer_size(peekaboo, &buffer_width, &buffer_height);
+
+  struct surface_buffer *surface_buffer =
+      get_next_buffer(&peekaboo->config, peekaboo->wl_shm,
+                      &peekaboo->surface_buffer_pool, buffer_width,
+                      buffer_height);
   if (surface_buffer == NULL) {
     return;
   }
@@ -64,17 +107,64 @@ static void send_frame(struct peekaboo *peekaboo) {
   wp_viewport_set_destination(peekaboo->wp_viewport, peekaboo->surface_width,
                               peekaboo->surface_height);
 
+  if (peekaboo->scene.opaque_changed) {
+    set_opaque_region(peekaboo, buffer_width, buffer_height);
+  }
   wl_surface_attach(peekaboo->wl_surface, surface_buffer->wl_buffer, 0, 0);
-  wl_surface_damage_buffer(peekaboo->wl_surface, 0, 0, peekaboo->surface_width,
-                           peekaboo->surface_height);
+  /* Only the previews that changed, so the compositor doesn't upload and
+   * composite the whole buffer again on every key press. */
+  cairo_region_t *damage = peekaboo->scene.damage;
+  for (int i = 0; i < cairo_region_num_rectangles(damage); i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(damage, i, &rect);
+    wl_surface_damage_buffer(peekaboo->wl_surface, rect.x, rect.y, rect.width,
+                             rect.height);
+  }
   wl_surface_commit(peekaboo->wl_surface);
 
+  peekaboo->first_frame_sent = true;
+  event_loop_timer_disarm(&peekaboo->first_frame_timer);
+  /* Once this frame is out, use the idle time before the next key press. */
+  event_loop_timer_arm(&peekaboo->event_loop, &peekaboo->prescale_timer, 0);
+  /* Some previews were drawn rough to stay within the frame budget. */
+  if (peekaboo->frame_incomplete) {
+    request_frame(peekaboo);
+  }
+
 #ifdef DEBUG
   log_debug("Frame sent after %ums\n", gettime_ms() - launch_time_ms);
 #endif
 }
 
+/* A frame was dropped for want of a buffer, and now there's one. */
+static void handle_surface_buffer_released(void *data) {
+  request_frame(data);
+}
+
+/* Whether every client has either been captured or been given up on. */
+static bool captures_settled(struct peekaboo *peekaboo) {
+  struct wm_client *wm_client;
+  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
+    if (!wm_client->ready && !wm_client->capture_failed) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static void request_frame(struct peekaboo *peekaboo) {
+  if (!peekaboo->first_frame_sent) {
+    /* Nothing is on screen yet, so there's no frame callback to wait for.
+     * Paint as soon as every capture is in; otherwise the first frame timer
+     * paints whatever we have by the deadline. */
+    if (peekaboo->configured && captures_settled(peekaboo)) {
+      send_frame(peekaboo);
+    }
+    return;
+  }
+
+  /* Only one frame callback is ever outstanding, so captures that come in
+   * between two frames get coalesced into a single repaint. */
   if (peekaboo->wl_surface_callback != NULL) {
     return;
   }
@@ -89,10 +179,11 @@ static void request_frame(struct peekaboo *peekaboo) {
 static void surface_callback_done(void *data, struct wl_callback *callback,
                                   uint32_t callback_data) {
   struct peekaboo *peekaboo = data;
-  send_frame(peekaboo);
-
+  /* Done first, so that send_frame() can ask for the next one. */
   wl_callback_destroy(peekaboo->wl_surface_callback);
   peekaboo->wl_surface_callback = NULL;
+
+  send_frame(peekaboo);
 }
 
 const struct wl_callback_listener surface_callback_listener = {
@@ -234,13 +325,49 @@ static void handle_layer_surface_configure(
   struct peekaboo *peekaboo = data;
   peekaboo->surface_width = width;
   peekaboo->surface_height = height;
+  peekaboo->configured = true;
   zwlr_layer_surface_v1_ack_configure(layer_surface, serial);
 
-  if (peekaboo->running) {
+  if (!peekaboo->running) {
+    return;
+  }
+
+  /* Don't let the slowest capture hold up the first frame. Wait for them
+   * only until the deadline, then paint placeholders for the stragglers. */
+  if (!peekaboo->first_frame_sent && !captures_settled(peekaboo) &&
+      peekaboo->config.first_frame_deadline_ms > 0) {
+    if (!peekaboo->first_frame_timer.armed) {
+      event_loop_timer_arm(&peekaboo->event_loop, &peekaboo->first_frame_timer,
+                           peekaboo->config.first_frame_deadline_ms);
+    }
+    return;
+  }
+
+  send_frame(peekaboo);
+}
+
+static void handle_first_frame_timer(void *data) {
+  struct peekaboo *peekaboo = data;
+#ifdef DEBUG
+  log_debug("First frame deadline hit after %ums\n",
+            gettime_ms() - launch_time_ms);
+#endif
+  if (!peekaboo->first_frame_sent && peekaboo->running) {
     send_frame(peekaboo);
   }
 }
 
+static void handle_prescale_timer(void *data) {
+  struct peekaboo *peekaboo = data;
+  if (!peekaboo->running) {
+    return;
+  }
+
+  uint32_t buffer_width, buffer_height;
+  get_buffer_size(peekaboo, &buffer_width, &buffer_height);
+  prescale_candidate_layouts(peekaboo, buffer_width, buffer_height);
+}
+
 static void
 handle_layer_surface_closed(void *data,
                             struct zwlr_layer_surface_v1 *layer_surface) {
@@ -353,6 +480,12 @@ static void registry_global(void *data, struct wl_registry *registry,
         wl_registry_bind(registry, name, &wl_compositor_interface, 4);
     log_debug("Bound to compositor %u.\n", name);
   }
+  /* wl_subcompositor */
+  else if (!strcmp(interface, wl_subcompositor_interface.name)) {
+    peekaboo->wl_subcompositor =
+        wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
+    log_debug("Bound to subcompositor %u.\n", name);
+  }
   /* wl_shm */
   else if (!strcmp(interface, wl_shm_interface.name)) {
     peekaboo->wl_shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
@@ -427,14 +560,18 @@ static void usage(bool err) {
       "\n"
       "Basic options:\n"
       "  -h, --help                           Print this message and exit.\n"
-      "  -c, --config <path>                  Specify a config file.\n");
+      "  -c, --config <path>                  Specify a config file.\n"
+      "  -t, --telemetry                      Print capture timings on exit.\n"
+      "\n"
+      "With --telemetry, send SIGUSR1 to print them while running.\n");
 }
 
 /* Option parsing with getopt. */
 const struct option long_options[] = {{"help", no_argument, NULL, 'h'},
                                       {"config", required_argument, NULL, 'c'},
+                                      {"telemetry", no_argument, NULL, 't'},
                                       {NULL, 0, NULL, 0}};
-const char *short_options = "hc:";
+const char *short_options = "hc:t";
 
 static void parse_args(struct peekaboo *peekaboo, int argc, char **argv) {
   int option_index = 0;
@@ -453,6 +590,8 @@ static void parse_args(struct peekaboo *peekaboo, int argc, char **argv) {
       peekaboo->config_path =
           realloc(peekaboo->config_path, strlen(optarg) + 1),
       strcpy(peekaboo->config_path, optarg);
+    } else if (opt == 't') {
+      peekaboo->print_telemetry = true;
     } else {
       usage(true);
       exit(EXIT_FAILURE);
@@ -470,6 +609,11 @@ int main(int argc, char **argv) {
               .client_filter_behavior = CLIENT_FILTER_BEHAVIOR_DIM,
               .font = "Sans",
               .font_size = 16,
+              .first_frame_deadline_ms = 16,
+              .scaled_cache_size_mb = 256,
+              .frame_budget_ms = 8,
+              .max_surface_buffers = 3,
+              .subsurface_previews = false,
               .preview = {.style =
                               {
                                   .background_color = 0x000000ff,
@@ -506,6 +650,22 @@ int main(int argc, char **argv) {
   peekaboo.wl_display = wl_display_connect(NULL);
   EXPECT_NON_NULL(peekaboo.wl_display, "Wayland compositor");
 
+  event_loop_init(&peekaboo.event_loop, peekaboo.wl_display);
+  event_loop_timer_init(&peekaboo.first_frame_timer, handle_first_frame_timer,
+                        &peekaboo);
+  event_loop_timer_init(&peekaboo.prescale_timer, handle_prescale_timer,
+                        &peekaboo);
+  surface_cache_budget_init(&peekaboo.surface_cache_budget,
+                            (size_t)peekaboo.config.scaled_cache_size_mb << 20);
+  if (!worker_pool_init(&peekaboo.worker_pool, &peekaboo.event_loop)) {
+    log_warning("Couldn't start worker threads, scaling on the main thread.\n");
+  }
+  if (!capture_thread_init(&peekaboo.capture_thread, &peekaboo.event_loop,
+                           peekaboo.wl_display)) {
+    log_warning("Couldn't start the capture thread, capturing on the main "
+                "thread.\n");
+  }
+
   peekaboo.wl_registry = wl_display_get_registry(peekaboo.wl_display);
   EXPECT_NON_NULL(peekaboo.wl_registry, "Wayland registry");
 
@@ -526,6 +686,11 @@ int main(int argc, char **argv) {
   EXPECT_NON_NULL(peekaboo.wp_viewporter, "wp_viewporter");
   EXPECT_NON_NULL(peekaboo.hyprland_toplevel_export_manager,
                   "hyprland_toplevel_export_manager");
+  peekaboo.subsurface_previews = peekaboo.config.subsurface_previews &&
+                                 peekaboo.wl_subcompositor != NULL;
+  if (peekaboo.config.subsurface_previews && !peekaboo.subsurface_previews) {
+    log_warning("No wl_subcompositor, scaling previews ourselves.\n");
+  }
 
   /* Prepare second roundtrip. */
   {
@@ -549,18 +714,29 @@ int main(int argc, char **argv) {
   /* Initialize a list of clients connected to the WM. */
   wm_clients_init(&peekaboo, &peekaboo.wm_clients, WM_CLIENT_HYPRLAND);
 
-  /* In the next roundtrip/dispatch, what should happen for hyprland's
+  /* Meanwhile, on the capture thread, what should happen for hyprland's
    * export_frames is:
    * 1. For each export_frame, we receive "buffer" event(s) informing us of
    * the buffer parameters like width, height, etc. that the export frames can
-   *    support. We currently only take the last event.
+   *    support.
    * 2. We receive a "buffer_done" event when there are no more "buffer"
-   * events. Then, we request a copy on the export_frame.
-   * 3. We receive a "ready" event when the copy is finished, allowing
-   *    previously unready preview windows to display a buffer.
+   *    events. Then, we pick the offered format that's cheapest to convert
+   *    to our render format and request a copy on the export_frame.
+   * 3. We receive a "ready" event when the copy is finished. The buffer is
+   *    converted to ARGB32 if needed and handed back to the main thread,
+   *    allowing previously unready preview windows to display a buffer.
    */
 
-  surface_buffer_pool_init(&peekaboo.surface_buffer_pool);
+  render_plan_compile(&peekaboo.render_plan, &peekaboo.config);
+  /* Subsurface previews show through holes in our buffer, which XRGB8888
+   * would fill in. */
+  surface_buffer_pool_init(&peekaboo.surface_buffer_pool,
+                           peekaboo.config.max_surface_buffers,
+                           peekaboo.render_plan.opaque &&
+                               !peekaboo.subsurface_previews,
+                           handle_surface_buffer_released, &peekaboo);
+  scene_init(&peekaboo.scene);
+  nine_slice_cache_init(&peekaboo.nine_slices);
   peekaboo.wl_surface = wl_compositor_create_surface(peekaboo.wl_compositor);
   wl_surface_add_listener(peekaboo.wl_surface, &surface_listener, &peekaboo);
 
@@ -600,13 +776,25 @@ int main(int argc, char **argv) {
 #endif
   wl_surface_commit(peekaboo.wl_surface);
 
-  while (peekaboo.running && wl_display_dispatch(peekaboo.wl_display) != -1) {
+  if (peekaboo.print_telemetry) {
+    telemetry_init();
+  }
+  while (peekaboo.running && event_loop_dispatch(&peekaboo.event_loop) != -1) {
+    telemetry_handle_signals();
   }
 
   if (peekaboo.selected_client != NULL) {
     wm_client_focus(peekaboo.selected_client);
   }
 
+  /* The switch has already happened, so the disk writes here don't hold up
+   * the user. */
+  wm_clients_store_thumbnails(&peekaboo.wm_clients);
+
+  if (peekaboo.print_telemetry) {
+    telemetry_print();
+  }
+
   /* Cleanup only when debugging to make sure we've handled everything
    * correctly.*/
   // {{{
@@ -647,8 +835,13 @@ int main(int argc, char **argv) {
     }
   }
 
+  capture_thread_destroy(&peekaboo.capture_thread);
   wm_clients_destroy(&peekaboo.wm_clients, WM_CLIENT_HYPRLAND);
+  worker_pool_destroy(&peekaboo.worker_pool);
   surface_buffer_pool_destroy(&peekaboo.surface_buffer_pool);
+  scene_destroy(&peekaboo.scene);
+  nine_slice_cache_destroy(&peekaboo.nine_slices);
+  render_plan_destroy(&peekaboo.render_plan);
   if (peekaboo.wl_surface_callback) {
     wl_callback_destroy(peekaboo.wl_surface_callback);
   }
@@ -665,6 +858,9 @@ int main(int argc, char **argv) {
 
   wl_shm_destroy(peekaboo.wl_shm);
   zwlr_layer_shell_v1_destroy(peekaboo.wl_layer_shell);
+  if (peekaboo.wl_subcompositor) {
+    wl_subcompositor_destroy(peekaboo.wl_subcompositor);
+  }
   wl_compositor_destroy(peekaboo.wl_compositor);
   wl_registry_destroy(peekaboo.wl_registry);
 
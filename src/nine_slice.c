@@ -0,0 +1,247 @@
+#include "nine_slice.h"
+#include "log.h"
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+static void draw_path(cairo_t *cr, const struct style_plan *plan, double x,
+                      double y, double width, double height) {
+  cairo_save(cr);
+
+  double radius = plan->style->border.radius;
+
+  double degrees = M_PI / 180.0;
+
+  cairo_new_sub_path(cr);
+  cairo_arc(cr, x + width - radius, y + radius, radius, -90 * degrees,
+            0 * degrees);
+  cairo_arc(cr, x + width - radius, y + height - radius, radius, 0 * degrees,
+            90 * degrees);
+  cairo_arc(cr, x + radius, y + height - radius, radius, 90 * degrees,
+            180 * degrees);
+  cairo_arc(cr, x + radius, y + radius, radius, 180 * degrees, 270 * degrees);
+  cairo_close_path(cr);
+
+  if (plan->has_background) {
+    cairo_set_source(cr, plan->background);
+    cairo_fill_preserve(cr);
+  }
+
+  if (plan->has_border) {
+    cairo_set_line_width(cr, plan->style->border.width);
+    cairo_set_source(cr, plan->border);
+    cairo_stroke(cr);
+  }
+
+  cairo_new_path(cr);
+  cairo_restore(cr);
+}
+
+/* A square box with a border an even number of pixels wide is drawn exactly
+ * by two rectangles: one for the background and a frame for the border. */
+static void draw_square(cairo_t *cr, const struct style_plan *plan,
+                        const struct rect *rect) {
+  cairo_save(cr);
+
+  if (plan->has_background) {
+    cairo_set_source(cr, plan->background);
+    cairo_rectangle(cr, rect->x, rect->y, rect->width, rect->height);
+    cairo_fill(cr);
+  }
+
+  if (plan->has_border) {
+    int32_t half = plan->style->border.width / 2;
+    cairo_set_source(cr, plan->border);
+    cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+    cairo_rectangle(cr, rect->x - half, rect->y - half, rect->width + 2 * half,
+                    rect->height + 2 * half);
+    if (rect->width > 2 * half && rect->height > 2 * half) {
+      cairo_rectangle(cr, rect->x + half, rect->y + half,
+                      rect->width - 2 * half, rect->height - 2 * half);
+    }
+    cairo_fill(cr);
+  }
+
+  cairo_restore(cr);
+}
+
+static cairo_surface_t *copy_strip(cairo_surface_t *surface, int32_t x,
+                                   int32_t y, int32_t width, int32_t height) {
+  cairo_surface_t *strip =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  cairo_t *cr = cairo_create(strip);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, surface, -x, -y);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  return strip;
+}
+
+/* The same reach as the scene gives a preview's border. */
+static int32_t spill_of(const struct element_style *element_style) {
+  return (element_style->border.width + 1) / 2 + 1;
+}
+
+int32_t nine_slice_inset(const struct element_style *element_style) {
+  return MAX((int32_t)element_style->border.radius, spill_of(element_style));
+}
+
+static void nine_slice_init(struct nine_slice *slice,
+                            const struct style_plan *plan) {
+  const struct element_style *element_style = plan->style;
+  slice->radius = element_style->border.radius;
+  slice->border_width = element_style->border.width;
+  slice->background_color = element_style->background_color;
+  slice->border_color = element_style->border.color;
+
+  slice->spill = spill_of(element_style);
+  slice->inset = nine_slice_inset(element_style);
+
+  int32_t middle = slice->spill + slice->inset;
+  int32_t size = 2 * middle + 1;
+  slice->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, size, size);
+  if (cairo_surface_status(slice->surface) != CAIRO_STATUS_SUCCESS) {
+    log_error("Could not allocate a nine-slice surface.\n");
+  }
+  cairo_t *cr = cairo_create(slice->surface);
+  draw_path(cr, plan, slice->spill, slice->spill,
+            2 * slice->inset + 1, 2 * slice->inset + 1);
+  cairo_destroy(cr);
+  cairo_surface_flush(slice->surface);
+
+  slice->top = copy_strip(slice->surface, middle, 0, 1, middle);
+  slice->bottom = copy_strip(slice->surface, middle, middle + 1, 1, middle);
+  slice->left = copy_strip(slice->surface, 0, middle, middle, 1);
+  slice->right = copy_strip(slice->surface, middle + 1, middle, middle, 1);
+}
+
+static void nine_slice_finish(struct nine_slice *slice) {
+  cairo_surface_destroy(slice->surface);
+  cairo_surface_destroy(slice->top);
+  cairo_surface_destroy(slice->bottom);
+  cairo_surface_destroy(slice->left);
+  cairo_surface_destroy(slice->right);
+  memset(slice, 0, sizeof(struct nine_slice));
+}
+
+void nine_slice_cache_init(struct nine_slice_cache *cache) {
+  memset(cache, 0, sizeof(struct nine_slice_cache));
+}
+
+void nine_slice_cache_destroy(struct nine_slice_cache *cache) {
+  for (uint32_t i = 0; i < cache->num_slices; i++) {
+    nine_slice_finish(&cache->slices[i]);
+  }
+  cache->num_slices = 0;
+}
+
+static struct nine_slice *get_nine_slice(struct nine_slice_cache *cache,
+                                         const struct style_plan *plan) {
+  const struct element_style *element_style = plan->style;
+  for (uint32_t i = 0; i < cache->num_slices; i++) {
+    struct nine_slice *slice = &cache->slices[i];
+    if (slice->radius == element_style->border.radius &&
+        slice->border_width == element_style->border.width &&
+        slice->background_color == element_style->background_color &&
+        slice->border_color == element_style->border.color) {
+      return slice;
+    }
+  }
+
+  struct nine_slice *slice;
+  if (cache->num_slices < NINE_SLICE_CACHE_SIZE) {
+    slice = &cache->slices[cache->num_slices++];
+  } else {
+    slice = &cache->slices[cache->next_evicted];
+    cache->next_evicted = (cache->next_evicted + 1) % NINE_SLICE_CACHE_SIZE;
+    nine_slice_finish(slice);
+  }
+  nine_slice_init(slice, plan);
+  return slice;
+}
+
+/* Whether user space is device space, give or take whole pixels. */
+static bool pixel_aligned(cairo_t *cr) {
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  return matrix.xx == 1.0 && matrix.yy == 1.0 && matrix.xy == 0.0 &&
+         matrix.yx == 0.0 && matrix.x0 == floor(matrix.x0) &&
+         matrix.y0 == floor(matrix.y0);
+}
+
+/* Fills `width` x `height` at (x, y) with `surface`, its top-left corner at
+ * (surface_x, surface_y) and its edge pixels stretched past its extents. */
+static void blit(cairo_t *cr, cairo_surface_t *surface, int32_t surface_x,
+                 int32_t surface_y, int32_t x, int32_t y, int32_t width,
+                 int32_t height) {
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+  cairo_set_source_surface(cr, surface, surface_x, surface_y);
+  cairo_pattern_t *pattern = cairo_get_source(cr);
+  cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+  cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+  cairo_rectangle(cr, x, y, width, height);
+  cairo_fill(cr);
+}
+
+void draw_rounded_rectangle(cairo_t *cr, struct nine_slice_cache *cache,
+                            const struct style_plan *plan,
+                            const struct rect *rect) {
+  if (!plan->has_background && !plan->has_border) {
+    return;
+  }
+  if (plan->square &&
+      (!plan->has_border || plan->style->border.width % 2 == 0)) {
+    draw_square(cr, plan, rect);
+    return;
+  }
+
+  int32_t inset = nine_slice_inset(plan->style);
+  if (rect->width < 2 * inset || rect->height < 2 * inset ||
+      !pixel_aligned(cr)) {
+    draw_path(cr, plan, rect->x, rect->y, rect->width, rect->height);
+    return;
+  }
+
+  struct nine_slice *slice = get_nine_slice(cache, plan);
+  int32_t spill = slice->spill;
+  int32_t middle = spill + inset;
+  int32_t x = rect->x;
+  int32_t y = rect->y;
+  int32_t right = rect->x + rect->width - inset;
+  int32_t bottom = rect->y + rect->height - inset;
+  int32_t inner_width = rect->width - 2 * inset;
+  int32_t inner_height = rect->height - 2 * inset;
+
+  cairo_save(cr);
+
+  // Corners
+  blit(cr, slice->surface, x - spill, y - spill, x - spill, y - spill, middle,
+       middle);
+  blit(cr, slice->surface, right - middle - 1, y - spill, right, y - spill,
+       middle, middle);
+  blit(cr, slice->surface, x - spill, bottom - middle - 1, x - spill, bottom,
+       middle, middle);
+  blit(cr, slice->surface, right - middle - 1, bottom - middle - 1, right,
+       bottom, middle, middle);
+
+  // Edges
+  blit(cr, slice->top, x + inset, y - spill, x + inset, y - spill, inner_width,
+       middle);
+  blit(cr, slice->bottom, x + inset, bottom, x + inset, bottom, inner_width,
+       middle);
+  blit(cr, slice->left, x - spill, y + inset, x - spill, y + inset, middle,
+       inner_height);
+  blit(cr, slice->right, right, y + inset, right, y + inset, middle,
+       inner_height);
+
+  // Middle
+  if (plan->has_background && inner_width > 0 && inner_height > 0) {
+    cairo_set_source(cr, plan->background);
+    cairo_rectangle(cr, x + inset, y + inset, inner_width, inner_height);
+    cairo_fill(cr);
+  }
+
+  cairo_restore(cr);
+}
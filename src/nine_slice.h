@@ -0,0 +1,64 @@
+#ifndef _NINE_SLICE_H_
+#define _NINE_SLICE_H_
+
+#include "layout.h"
+#include "render_plan.h"
+#include "styles.h"
+#include <cairo.h>
+#include <stdint.h>
+
+/* Every preview, title and shortcut sits in a rounded rectangle, and all the
+ * boxes of one style look the same but for their size. So instead of filling
+ * and stroking a path for each box, every style is rasterized once, as a small
+ * box, and boxes of any size are put together from its slices: the corners as
+ * they are, the edges stretched from a one pixel strip, and the middle filled
+ * with the background color. */
+
+struct nine_slice {
+  /* What the slices were drawn with. */
+  uint32_t        radius;
+  uint32_t        border_width;
+  color_t         background_color;
+  color_t         border_color;
+
+  /* How far each corner reaches into the box, and how far the border, and
+   * its antialiasing, reach out of it. */
+  int32_t         inset;
+  int32_t         spill;
+
+  /* A box 2 * inset + 1 pixels square, with room for the spill around it. */
+  cairo_surface_t *surface;
+  /* One pixel strips through the middle of each of its edges. */
+  cairo_surface_t *top;
+  cairo_surface_t *bottom;
+  cairo_surface_t *left;
+  cairo_surface_t *right;
+};
+
+/* There are only ever a handful of styles on screen. */
+#define NINE_SLICE_CACHE_SIZE 8
+
+struct nine_slice_cache {
+  struct nine_slice slices[NINE_SLICE_CACHE_SIZE];
+  uint32_t          num_slices;
+  /* Which slice goes next once the cache is full. */
+  uint32_t          next_evicted;
+};
+
+/* How far into a box of the given style its corners and border reach. Past
+ * that, every row and column of the box is the same as the next. */
+int32_t nine_slice_inset(const struct element_style *element_style);
+
+void nine_slice_cache_init(struct nine_slice_cache *cache);
+void nine_slice_cache_destroy(struct nine_slice_cache *cache);
+
+/* Draws a rounded rectangle around `rect`, with the background and border of
+ * the style. Boxes with nothing to show are skipped, and square ones are plain
+ * rectangles when their border lands on whole pixels. Boxes too small to be
+ * sliced, and targets that aren't drawn to on whole pixels, get the path
+ * filled and stroked instead. */
+void draw_rounded_rectangle(cairo_t *cr, struct nine_slice_cache *cache,
+                            const struct style_plan *plan,
+                            const struct rect *rect);
+
+#endif /* _NINE_SLICE_H_ */
@@ -1,10 +1,16 @@
 #ifndef _PEEKABOO_H_
 #define _PEEKABOO_H_
 
+#include "capture_thread.h"
 #include "config.h"
+#include "event_loop.h"
 #include "hyprland-toplevel-export-v1.h"
+#include "nine_slice.h"
+#include "render_plan.h"
+#include "scene.h"
 #include "surface.h"
 #include "wayland-client-core.h"
+#include "worker_pool.h"
 
 #define MAX_INPUT_LENGTH 512
 
@@ -38,10 +44,12 @@ struct toplevel_handle {
 struct peekaboo {
   struct config                              config;
   char                                       *config_path;
+  bool                                       print_telemetry;
 
   struct wl_display                          *wl_display;
   struct wl_registry                         *wl_registry;
   struct wl_compositor                       *wl_compositor;
+  struct wl_subcompositor                    *wl_subcompositor;
   struct zwlr_layer_shell_v1                 *wl_layer_shell;
   struct zwlr_virtual_pointer_manager_v1     *wl_virtual_pointer_mgr;
   struct wp_viewporter                       *wp_viewporter;
@@ -66,7 +74,36 @@ struct peekaboo {
   int                                        shm_fd;
   size_t                                     shm_size;
 
+  struct event_loop                          event_loop;
+  /* We hold the first frame back until every capture is in, or until this
+   * fires, whichever comes first. */
+  struct event_loop_timer                    first_frame_timer;
+  bool                                       configured;
+  bool                                       first_frame_sent;
+  /* Fires right after a frame to scale ahead for the next key press, see
+   * prescale_candidate_layouts(). */
+  struct event_loop_timer                    prescale_timer;
+  /* Past this, render() stops scaling on the main thread and draws rough
+   * versions instead, setting frame_incomplete to get another frame. */
+  uint32_t                                   frame_deadline_ms;
+  bool                                       frame_incomplete;
+
+  struct worker_pool                         worker_pool;
+  /* Export frames and their events live on this thread, see
+   * capture_thread.h. */
+  struct capture_thread                      capture_thread;
+  struct surface_cache_budget                surface_cache_budget;
+  /* config.subsurface_previews, if the compositor lets us, see
+   * render_wm_client_subsurface(). */
+  bool                                       subsurface_previews;
+
   struct surface_buffer_pool                 surface_buffer_pool;
+  /* What was drawn last frame, see scene.h. */
+  struct scene                               scene;
+  /* The rounded rectangles of every style drawn, see nine_slice.h. */
+  struct nine_slice_cache                    nine_slices;
+  /* The config, compiled for render(), see render_plan.h. */
+  struct render_plan                         render_plan;
   uint32_t                                   surface_height;
   uint32_t                                   surface_width;
   uint32_t fractional_scale;                 // scale / 120
@@ -0,0 +1,433 @@
+#include "pixel.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wayland-client-protocol.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define PIXEL_X86
+#include <immintrin.h>
+#endif
+
+/* Describes how to get from a wl_shm format to ARGB8888 (in memory, B G R A
+ * on little-endian). `shuffle[i]` is the source byte that should end up in
+ * destination byte `i` of each pixel. */
+struct pixel_format_conversion {
+  uint32_t format;
+  int32_t  cost;
+  bool     identity;
+  bool     alpha_fill;
+  uint8_t  shuffle[4];
+};
+
+static const struct pixel_format_conversion conversions[] = {
+    /* Maps directly onto our render format. */
+    {WL_SHM_FORMAT_ARGB8888, 0, true, false, {0, 1, 2, 3}},
+    /* Only the alpha channel needs fixing up. */
+    {WL_SHM_FORMAT_XRGB8888, 1, true, true, {0, 1, 2, 3}},
+    /* Channels need to be moved around. */
+    {WL_SHM_FORMAT_ABGR8888, 2, false, false, {2, 1, 0, 3}},
+    {WL_SHM_FORMAT_XBGR8888, 3, false, true, {2, 1, 0, 3}},
+    {WL_SHM_FORMAT_BGRA8888, 2, false, false, {3, 2, 1, 0}},
+    {WL_SHM_FORMAT_BGRX8888, 3, false, true, {3, 2, 1, 0}},
+    {WL_SHM_FORMAT_RGBA8888, 2, false, false, {1, 2, 3, 0}},
+    {WL_SHM_FORMAT_RGBX8888, 3, false, true, {1, 2, 3, 0}},
+};
+
+static const struct pixel_format_conversion *
+find_conversion(uint32_t format) {
+  for (size_t i = 0; i < sizeof(conversions) / sizeof(conversions[0]); i++) {
+    if (conversions[i].format == format) {
+      return &conversions[i];
+    }
+  }
+  return NULL;
+}
+
+int32_t pixel_format_cost(uint32_t format) {
+  const struct pixel_format_conversion *conversion = find_conversion(format);
+  return conversion == NULL ? -1 : conversion->cost;
+}
+
+int32_t pixel_format_pick(const uint32_t *formats, uint32_t num_formats) {
+  int32_t best_index = -1;
+  int32_t best_cost = INT32_MAX;
+  for (uint32_t i = 0; i < num_formats; i++) {
+    int32_t cost = pixel_format_cost(formats[i]);
+    if (cost >= 0 && cost < best_cost) {
+      best_index = i;
+      best_cost = cost;
+    }
+  }
+  return best_index;
+}
+
+// Row kernels {{{
+static void swizzle_row_scalar(uint8_t *row, uint32_t width,
+                               const struct pixel_format_conversion *conv) {
+  const uint8_t alpha_or = conv->alpha_fill ? 0xff : 0x00;
+  for (uint32_t x = 0; x < width; x++) {
+    uint8_t *px = &row[x * 4];
+    uint8_t b = px[conv->shuffle[0]];
+    uint8_t g = px[conv->shuffle[1]];
+    uint8_t r = px[conv->shuffle[2]];
+    uint8_t a = px[conv->shuffle[3]];
+    px[0] = b;
+    px[1] = g;
+    px[2] = r;
+    px[3] = a | alpha_or;
+  }
+}
+
+static void alpha_fill_row_scalar(uint8_t *row, uint32_t width) {
+  uint32_t *px = (uint32_t *)row;
+  for (uint32_t x = 0; x < width; x++) {
+    px[x] |= 0xff000000;
+  }
+}
+
+#ifdef PIXEL_X86
+static void alpha_fill_row_sse2(uint8_t *row, uint32_t width) {
+  const __m128i alpha = _mm_set1_epi32((int32_t)0xff000000);
+  uint32_t x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i *p = (__m128i *)&row[x * 4];
+    _mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), alpha));
+  }
+  alpha_fill_row_scalar(&row[x * 4], width - x);
+}
+
+__attribute__((target("ssse3"))) static void
+swizzle_row_ssse3(uint8_t *row, uint32_t width,
+                  const struct pixel_format_conversion *conv) {
+  const uint8_t *s = conv->shuffle;
+  const __m128i mask = _mm_setr_epi8(
+      s[0], s[1], s[2], s[3], s[0] + 4, s[1] + 4, s[2] + 4, s[3] + 4,
+      s[0] + 8, s[1] + 8, s[2] + 8, s[3] + 8, s[0] + 12, s[1] + 12,
+      s[2] + 12, s[3] + 12);
+  const __m128i alpha =
+      _mm_set1_epi32(conv->alpha_fill ? (int32_t)0xff000000 : 0);
+  uint32_t x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i *p = (__m128i *)&row[x * 4];
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+    _mm_storeu_si128(p, _mm_or_si128(v, alpha));
+  }
+  swizzle_row_scalar(&row[x * 4], width - x, conv);
+}
+
+__attribute__((target("avx2"))) static void
+swizzle_row_avx2(uint8_t *row, uint32_t width,
+                 const struct pixel_format_conversion *conv) {
+  const uint8_t *s = conv->shuffle;
+  /* vpshufb shuffles within each 128-bit lane, so the mask repeats. */
+  const __m256i mask = _mm256_setr_epi8(
+      s[0], s[1], s[2], s[3], s[0] + 4, s[1] + 4, s[2] + 4, s[3] + 4,
+      s[0] + 8, s[1] + 8, s[2] + 8, s[3] + 8, s[0] + 12, s[1] + 12,
+      s[2] + 12, s[3] + 12, s[0], s[1], s[2], s[3], s[0] + 4, s[1] + 4,
+      s[2] + 4, s[3] + 4, s[0] + 8, s[1] + 8, s[2] + 8, s[3] + 8, s[0] + 12,
+      s[1] + 12, s[2] + 12, s[3] + 12);
+  const __m256i alpha =
+      _mm256_set1_epi32(conv->alpha_fill ? (int32_t)0xff000000 : 0);
+  uint32_t x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256i *p = (__m256i *)&row[x * 4];
+    __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask);
+    _mm256_storeu_si256(p, _mm256_or_si256(v, alpha));
+  }
+  swizzle_row_ssse3(&row[x * 4], width - x, conv);
+}
+#endif /* PIXEL_X86 */
+// }}}
+
+// Darkening {{{
+/* Black at `alpha` over a premultiplied pixel scales every channel by
+ * 255 - alpha, and adds alpha to its alpha. The division by 255 rounds the
+ * same way pixman does, so all variants match cairo to the bit. */
+static void darken_row_scalar(uint8_t *row, uint32_t width, uint8_t alpha) {
+  const uint32_t keep = 255 - alpha;
+  for (uint32_t x = 0; x < width; x++) {
+    uint8_t *px = &row[x * 4];
+    for (int c = 0; c < 4; c++) {
+      uint32_t t = px[c] * keep + 0x80;
+      px[c] = (t + (t >> 8)) >> 8;
+    }
+    px[3] += alpha;
+  }
+}
+
+#ifdef PIXEL_X86
+static inline __m128i darken_sse2(__m128i v, __m128i keep, __m128i add) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(0x80);
+  __m128i lo = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), keep), round);
+  __m128i hi = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), keep), round);
+  lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+  hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+  return _mm_add_epi8(_mm_packus_epi16(lo, hi), add);
+}
+
+static void darken_row_sse2(uint8_t *row, uint32_t width, uint8_t alpha) {
+  const __m128i keep = _mm_set1_epi16(255 - alpha);
+  const __m128i add = _mm_set1_epi32((int32_t)((uint32_t)alpha << 24));
+  uint32_t x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i *p = (__m128i *)&row[x * 4];
+    _mm_storeu_si128(p, darken_sse2(_mm_loadu_si128(p), keep, add));
+  }
+  darken_row_scalar(&row[x * 4], width - x, alpha);
+}
+
+__attribute__((target("avx2"))) static void
+darken_row_avx2(uint8_t *row, uint32_t width, uint8_t alpha) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i keep = _mm256_set1_epi16(255 - alpha);
+  const __m256i round = _mm256_set1_epi16(0x80);
+  const __m256i add = _mm256_set1_epi32((int32_t)((uint32_t)alpha << 24));
+  uint32_t x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256i *p = (__m256i *)&row[x * 4];
+    __m256i v = _mm256_loadu_si256(p);
+    /* Unpacking and packing both work per 128-bit lane, so the pixels come
+     * back out in order. */
+    __m256i lo = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), keep), round);
+    __m256i hi = _mm256_add_epi16(
+        _mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), keep), round);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+    _mm256_storeu_si256(p, _mm256_add_epi8(_mm256_packus_epi16(lo, hi), add));
+  }
+  darken_row_sse2(&row[x * 4], width - x, alpha);
+}
+#endif /* PIXEL_X86 */
+
+void pixel_darken(void *data, uint32_t width, uint32_t height, uint32_t stride,
+                  uint8_t alpha) {
+  void (*darken_row)(uint8_t *, uint32_t, uint8_t) = darken_row_scalar;
+#ifdef PIXEL_X86
+  darken_row = darken_row_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    darken_row = darken_row_avx2;
+  }
+#endif
+
+  uint8_t *row = data;
+  for (uint32_t y = 0; y < height; y++, row += stride) {
+    darken_row(row, width, alpha);
+  }
+}
+// }}}
+
+// Hashing {{{
+/* This is a cut-down XXH3: 4 lanes of 64-bit multiply-accumulate over 32-byte
+ * stripes, keyed by a per-stripe secret and scrambled every block and every
+ * row so that moving content around (e.g. scrolling) changes the hash. The
+ * SIMD variants compute exactly the same function as the scalar one. */
+#define HASH_LANES 4
+#define HASH_STRIPE_SIZE 32
+#define HASH_STRIPES_PER_BLOCK 8
+#define HASH_PRIME32_1 0x9E3779B1u
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+
+static const uint64_t hash_secret[HASH_STRIPES_PER_BLOCK * HASH_LANES] = {
+    0x3120288007fd2a22ull, 0xddf2dbe8e6982718ull, 0xa0cc0a37f2ae1eebull,
+    0x7a8790c853f8b90eull, 0x26bdc8b56ccd1a1cull, 0x1b4a835ed7280af2ull,
+    0xe59cb63bdb269858ull, 0x6783f95f4a2fa00bull, 0xc02f5d2fd5b51f3eull,
+    0xcf58b45e8ddbeb20ull, 0xc35aae62d6281b1aull, 0x7d16d369adc612c7ull,
+    0xbb5702281ca09c15ull, 0x0c4ddd7b50d2663cull, 0xcc77e095b738c2d3ull,
+    0xd0428e4585a07e9full, 0x3081617de51a2ac6ull, 0x4d1f5ff3fcd05cf4ull,
+    0xe6f30b345f221746ull, 0x44c2d5f83ba4c2daull, 0x2b99f985e349875bull,
+    0xd8b293f0ac57744eull, 0xc18f4719413bd42bull, 0x66499bfe09c8bfe9ull,
+    0xd51a918fe1743a6bull, 0x6488f7f4a77ea2cdull, 0x1dc0ef74f1801714ull,
+    0xd0586048b33f1d8aull, 0xf0bae7dd2e9e0d04ull, 0x1172b1bd465b9f8cull,
+    0xbd4a69cb0ffba591ull, 0x31313df433cfb597ull,
+};
+static const uint64_t *const hash_scramble_secret =
+    &hash_secret[(HASH_STRIPES_PER_BLOCK - 1) * HASH_LANES];
+
+static void hash_scramble_scalar(uint64_t *acc) {
+  for (int i = 0; i < HASH_LANES; i++) {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= hash_scramble_secret[i];
+    acc[i] = a * HASH_PRIME32_1;
+  }
+}
+
+static void hash_stripes_scalar(uint64_t *acc, const uint8_t *p,
+                                uint32_t num_stripes) {
+  for (uint32_t s = 0; s < num_stripes; s++, p += HASH_STRIPE_SIZE) {
+    const uint64_t *key =
+        &hash_secret[(s % HASH_STRIPES_PER_BLOCK) * HASH_LANES];
+    for (int i = 0; i < HASH_LANES; i++) {
+      uint64_t d;
+      memcpy(&d, p + 8 * i, sizeof(d));
+      uint64_t dk = d ^ key[i];
+      acc[i ^ 1] += d;
+      acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+    if (s % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1) {
+      hash_scramble_scalar(acc);
+    }
+  }
+}
+
+#ifdef PIXEL_X86
+static inline __m128i hash_accumulate_sse2(__m128i acc, __m128i data,
+                                           __m128i key) {
+  __m128i data_key = _mm_xor_si128(data, key);
+  __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+  __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+  __m128i data_swap = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+  return _mm_add_epi64(_mm_add_epi64(acc, data_swap), product);
+}
+
+static inline __m128i hash_scramble_sse2(__m128i acc, __m128i key) {
+  const __m128i prime = _mm_set1_epi32(HASH_PRIME32_1);
+  __m128i data_key = _mm_xor_si128(_mm_xor_si128(acc, _mm_srli_epi64(acc, 47)),
+                                   key);
+  __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+  __m128i product_lo = _mm_mul_epu32(data_key, prime);
+  __m128i product_hi = _mm_mul_epu32(data_key_hi, prime);
+  return _mm_add_epi64(product_lo, _mm_slli_epi64(product_hi, 32));
+}
+
+static void hash_stripes_sse2(uint64_t *acc, const uint8_t *p,
+                              uint32_t num_stripes) {
+  __m128i acc0 = _mm_loadu_si128((const __m128i *)&acc[0]);
+  __m128i acc1 = _mm_loadu_si128((const __m128i *)&acc[2]);
+  for (uint32_t s = 0; s < num_stripes; s++, p += HASH_STRIPE_SIZE) {
+    const uint64_t *key =
+        &hash_secret[(s % HASH_STRIPES_PER_BLOCK) * HASH_LANES];
+    acc0 = hash_accumulate_sse2(acc0, _mm_loadu_si128((const __m128i *)p),
+                                _mm_loadu_si128((const __m128i *)&key[0]));
+    acc1 =
+        hash_accumulate_sse2(acc1, _mm_loadu_si128((const __m128i *)(p + 16)),
+                             _mm_loadu_si128((const __m128i *)&key[2]));
+    if (s % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1) {
+      acc0 = hash_scramble_sse2(
+          acc0, _mm_loadu_si128((const __m128i *)&hash_scramble_secret[0]));
+      acc1 = hash_scramble_sse2(
+          acc1, _mm_loadu_si128((const __m128i *)&hash_scramble_secret[2]));
+    }
+  }
+  _mm_storeu_si128((__m128i *)&acc[0], acc0);
+  _mm_storeu_si128((__m128i *)&acc[2], acc1);
+}
+
+__attribute__((target("avx2"))) static void
+hash_stripes_avx2(uint64_t *acc, const uint8_t *p, uint32_t num_stripes) {
+  const __m256i prime = _mm256_set1_epi32(HASH_PRIME32_1);
+  const __m256i scramble_key =
+      _mm256_loadu_si256((const __m256i *)hash_scramble_secret);
+  __m256i acc_vec = _mm256_loadu_si256((const __m256i *)acc);
+  for (uint32_t s = 0; s < num_stripes; s++, p += HASH_STRIPE_SIZE) {
+    const uint64_t *key =
+        &hash_secret[(s % HASH_STRIPES_PER_BLOCK) * HASH_LANES];
+    __m256i data = _mm256_loadu_si256((const __m256i *)p);
+    __m256i data_key =
+        _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i *)key));
+    __m256i data_key_hi =
+        _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+    __m256i product = _mm256_mul_epu32(data_key, data_key_hi);
+    __m256i data_swap = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+    acc_vec =
+        _mm256_add_epi64(_mm256_add_epi64(acc_vec, data_swap), product);
+
+    if (s % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1) {
+      __m256i a = _mm256_xor_si256(
+          _mm256_xor_si256(acc_vec, _mm256_srli_epi64(acc_vec, 47)),
+          scramble_key);
+      __m256i a_hi = _mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1));
+      acc_vec = _mm256_add_epi64(
+          _mm256_mul_epu32(a, prime),
+          _mm256_slli_epi64(_mm256_mul_epu32(a_hi, prime), 32));
+    }
+  }
+  _mm256_storeu_si256((__m256i *)acc, acc_vec);
+}
+#endif /* PIXEL_X86 */
+
+uint64_t pixel_hash(const void *data, uint32_t width, uint32_t height,
+                    uint32_t stride) {
+  void (*hash_stripes)(uint64_t *, const uint8_t *, uint32_t) =
+      hash_stripes_scalar;
+#ifdef PIXEL_X86
+  hash_stripes = hash_stripes_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    hash_stripes = hash_stripes_avx2;
+  }
+#endif
+
+  uint64_t acc[HASH_LANES] = {HASH_PRIME32_1, HASH_PRIME64_1, HASH_PRIME64_2,
+                              HASH_PRIME32_1};
+  const uint32_t row_size = width * 4;
+  const uint32_t num_stripes = row_size / HASH_STRIPE_SIZE;
+
+  const uint8_t *row = data;
+  for (uint32_t y = 0; y < height; y++, row += stride) {
+    hash_stripes(acc, row, num_stripes);
+
+    /* Whatever doesn't fill a whole stripe, one pixel at a time. */
+    for (uint32_t x = num_stripes * HASH_STRIPE_SIZE; x < row_size; x += 4) {
+      uint32_t px;
+      memcpy(&px, row + x, sizeof(px));
+      acc[(x / 4) % HASH_LANES] +=
+          (px ^ (uint32_t)hash_secret[(x / 4) % HASH_LANES]) *
+          (uint64_t)HASH_PRIME32_1;
+    }
+    hash_scramble_scalar(acc);
+  }
+
+  uint64_t h = (uint64_t)row_size * height * HASH_PRIME64_1;
+  for (int i = 0; i < HASH_LANES; i++) {
+    uint64_t a = acc[i] ^ hash_secret[i];
+    a ^= a >> 33;
+    a *= HASH_PRIME64_2;
+    h = (h ^ a) * HASH_PRIME64_1;
+  }
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ull;
+  h ^= h >> 32;
+  return h;
+}
+// }}}
+
+bool pixel_convert_to_argb32(void *data, uint32_t width, uint32_t height,
+                             uint32_t stride, uint32_t format) {
+  const struct pixel_format_conversion *conv = find_conversion(format);
+  if (conv == NULL) {
+    return false;
+  }
+  if (conv->identity && !conv->alpha_fill) {
+    return true;
+  }
+
+  void (*alpha_fill_row)(uint8_t *, uint32_t) = alpha_fill_row_scalar;
+  void (*swizzle_row)(uint8_t *, uint32_t,
+                      const struct pixel_format_conversion *) =
+      swizzle_row_scalar;
+#ifdef PIXEL_X86
+  alpha_fill_row = alpha_fill_row_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    swizzle_row = swizzle_row_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    swizzle_row = swizzle_row_ssse3;
+  }
+#endif
+
+  uint8_t *row = data;
+  for (uint32_t y = 0; y < height; y++, row += stride) {
+    if (conv->identity) {
+      alpha_fill_row(row, width);
+    } else {
+      swizzle_row(row, width, conv);
+    }
+  }
+  return true;
+}
+// vim:foldmethod=marker
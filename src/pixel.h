@@ -0,0 +1,36 @@
+#ifndef _PIXEL_H_
+#define _PIXEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Small, vectorized kernels that operate directly on 32-bit pixel buffers.
+ * Everything we render with is CAIRO_FORMAT_ARGB32, which on little-endian
+ * machines is exactly WL_SHM_FORMAT_ARGB8888. */
+
+/* How expensive it is to turn a buffer of the given wl_shm format into
+ * ARGB8888. Lower is cheaper. Returns -1 if we can't convert the format at
+ * all. */
+int32_t pixel_format_cost(uint32_t format);
+
+/* Out of `num_formats` offered wl_shm formats, return the index of the one
+ * that is cheapest to convert to ARGB8888, or -1 if none are supported. */
+int32_t pixel_format_pick(const uint32_t *formats, uint32_t num_formats);
+
+/* Converts, in place, a buffer of the given wl_shm format into ARGB8888.
+ * Returns false if the format isn't supported. */
+bool pixel_convert_to_argb32(void *data, uint32_t width, uint32_t height,
+                             uint32_t stride, uint32_t format);
+
+/* Composites black at `alpha` over an ARGB32 buffer, in place, exactly as
+ * cairo would. */
+void pixel_darken(void *data, uint32_t width, uint32_t height, uint32_t stride,
+                  uint8_t alpha);
+
+/* A fast, non-cryptographic 64-bit hash of the visible pixels of a buffer,
+ * i.e. ignoring any padding at the end of each row. Used to tell whether a
+ * new capture differs from the previous one at all. */
+uint64_t pixel_hash(const void *data, uint32_t width, uint32_t height,
+                    uint32_t stride);
+
+#endif /* _PIXEL_H_ */
@@ -1,11 +1,16 @@
 #include "preview.h"
 #include "layout.h"
 #include "log.h"
+#include "nine_slice.h"
 #include "pango/pango-layout.h"
 #include "pango/pango-types.h"
 #include "peekaboo.h"
+#include "render_plan.h"
 #include "styles.h"
 #include "surface.h"
+#include "telemetry.h"
+#include "text_layout.h"
+#include "thumbnail_cache.h"
 #include "util.h"
 #include "vec.h"
 #include "wm_client/wm_client.h"
@@ -13,70 +18,271 @@
 #include <glib.h>
 #include <pango/pangocairo.h>
 #include <unistd.h>
+#include <viewporter.h>
 #include <wayland-util.h>
 #include <xkbcommon/xkbcommon-keysyms.h>
 #include <xkbcommon/xkbcommon.h>
 
-void draw_rounded_rectangle(cairo_t *cr, cairo_surface_t *base_surface,
-                            const struct element_style *element_style,
-                            const struct rect *rect) {
-  double x = rect->x;
-  double y = rect->y;
-  double width = rect->width;
-  double height = rect->height;
+/* Until the capture is ready, show the thumbnail from the last launch. */
+void render_wm_client_disk_thumbnail(cairo_t *cr, struct wm_client *wm_client,
+                                     int32_t x, int32_t y, int32_t width,
+                                     int32_t height) {
+  uint32_t box_width = width;
+  uint32_t box_height = height;
+  if (wm_client->disk_thumbnail_box_width != box_width ||
+      wm_client->disk_thumbnail_box_height != box_height) {
+    if (wm_client->disk_thumbnail) {
+      cairo_surface_destroy(wm_client->disk_thumbnail);
+    }
+    wm_client->disk_thumbnail =
+        thumbnail_cache_load(wm_client_id(wm_client), box_width, box_height);
+    wm_client->disk_thumbnail_box_width = box_width;
+    wm_client->disk_thumbnail_box_height = box_height;
+  }
+
+  if (wm_client->disk_thumbnail == NULL) {
+    return;
+  }
 
   cairo_save(cr);
+  int32_t offset_x =
+      (width - cairo_image_surface_get_width(wm_client->disk_thumbnail)) / 2;
+  int32_t offset_y =
+      (height - cairo_image_surface_get_height(wm_client->disk_thumbnail)) / 2;
+  cairo_set_source_surface(cr, wm_client->disk_thumbnail, x + offset_x,
+                           y + offset_y);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+
+/* The size of the client's thumbnail when fit into a box of the given size. */
+static double thumbnail_scale(struct wm_client *wm_client, double width,
+                              double height) {
+  // Preserve aspect ratio when scaling
+  double scale_x = (double)width / wm_client->width;
+  double scale_y = (double)height / wm_client->height;
+  return fmin(scale_x, scale_y);
+}
 
-  double radius = element_style->border.radius;
+static void scaled_surface_drawn(struct wm_client *wm_client) {
+  telemetry_mark(&wm_client->telemetry, TELEMETRY_STAGE_SCALED);
 
-  double degrees = M_PI / 180.0;
+  /* The live capture replaces whatever we had from the disk cache. */
+  if (wm_client->disk_thumbnail) {
+    cairo_surface_destroy(wm_client->disk_thumbnail);
+    wm_client->disk_thumbnail = NULL;
+  }
+}
 
-  cairo_new_sub_path(cr);
-  cairo_arc(cr, x + width - radius, y + radius, radius, -90 * degrees,
-            0 * degrees);
-  cairo_arc(cr, x + width - radius, y + height - radius, radius, 0 * degrees,
-            90 * degrees);
-  cairo_arc(cr, x + radius, y + height - radius, radius, 90 * degrees,
-            180 * degrees);
-  cairo_arc(cr, x + radius, y + radius, radius, 180 * degrees, 270 * degrees);
-  cairo_close_path(cr);
+/* Nearest-neighbour from the closest pyramid level: rough, but it only costs
+ * as much as the pixels it covers. */
+static void render_wm_client_fallback_surface(cairo_t *cr,
+                                              struct wm_client *wm_client,
+                                              int32_t x, int32_t y) {
+  cairo_surface_t *fallback_surface = surface_cache_get_fallback(
+      wm_client->surface_cache, wm_client->preview_thumbnail_width,
+      wm_client->preview_thumbnail_height);
+  double scale_x = (double)wm_client->preview_thumbnail_width /
+                   cairo_image_surface_get_width(fallback_surface);
+  double scale_y = (double)wm_client->preview_thumbnail_height /
+                   cairo_image_surface_get_height(fallback_surface);
 
-  cairo_set_source_u32(cr, element_style->background_color);
-  cairo_fill_preserve(cr);
+  cairo_save(cr);
+  cairo_translate(cr, x, y);
+  cairo_scale(cr, scale_x, scale_y);
+  cairo_set_source_surface(cr, fallback_surface, 0, 0);
+  cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
 
-  cairo_set_line_width(cr, element_style->border.width);
-  cairo_set_source_u32(cr, element_style->border.color);
-  cairo_stroke(cr);
+/* Scales the capture straight into the buffer we're drawing to at (x, y),
+ * see surface_cache_scale_into(). That takes drawing to an image surface at
+ * whole pixels, through at most a rectangular clip. */
+static bool render_wm_client_direct(cairo_t *cr, struct wm_client *wm_client,
+                                    int32_t x, int32_t y) {
+  cairo_surface_t *target = cairo_get_target(cr);
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+      matrix.xx != 1 || matrix.yy != 1 || matrix.xy != 0 || matrix.yx != 0 ||
+      matrix.x0 != floor(matrix.x0) || matrix.y0 != floor(matrix.y0)) {
+    return false;
+  }
 
+  cairo_rectangle_list_t *clip_rects = cairo_copy_clip_rectangle_list(cr);
+  bool drawn = false;
+  if (clip_rects->status == CAIRO_STATUS_SUCCESS &&
+      clip_rects->num_rectangles == 1) {
+    cairo_rectangle_t *clip_rect = &clip_rects->rectangles[0];
+    double clip_x = clip_rect->x, clip_y = clip_rect->y;
+    double device_x = x, device_y = y;
+    cairo_user_to_device(cr, &clip_x, &clip_y);
+    cairo_user_to_device(cr, &device_x, &device_y);
+    cairo_rectangle_int_t clip = {
+        .x = ceil(clip_x),
+        .y = ceil(clip_y),
+        .width = floor(clip_x + clip_rect->width) - ceil(clip_x),
+        .height = floor(clip_y + clip_rect->height) - ceil(clip_y),
+    };
+    drawn = surface_cache_scale_into(
+        wm_client->surface_cache, wm_client->preview_thumbnail_width,
+        wm_client->preview_thumbnail_height, target, device_x, device_y,
+        &clip);
+  }
+  cairo_rectangle_list_destroy(clip_rects);
+  return drawn;
+}
+
+/* With subsurface previews, the capture is attached as is to a subsurface
+ * below ours, which the compositor scales to the thumbnail's size and which
+ * shows through a hole we leave in our buffer. Titles, shortcuts and dimming
+ * stay in our buffer, on top of it. */
+static void render_wm_client_subsurface(cairo_t *cr,
+                                        struct wm_client *wm_client, int32_t x,
+                                        int32_t y) {
+  struct peekaboo *peekaboo = wm_client->peekaboo;
+  if (wm_client->preview_wl_surface == NULL) {
+    wm_client->preview_wl_surface =
+        wl_compositor_create_surface(peekaboo->wl_compositor);
+    wm_client->preview_wl_subsurface = wl_subcompositor_get_subsurface(
+        peekaboo->wl_subcompositor, wm_client->preview_wl_surface,
+        peekaboo->wl_surface);
+    wl_subsurface_place_below(wm_client->preview_wl_subsurface,
+                              peekaboo->wl_surface);
+    wm_client->preview_wp_viewport = wp_viewporter_get_viewport(
+        peekaboo->wp_viewporter, wm_client->preview_wl_surface);
+
+    /* Keyboard focus and everything else stays with our surface. */
+    struct wl_region *wl_region =
+        wl_compositor_create_region(peekaboo->wl_compositor);
+    wl_surface_set_input_region(wm_client->preview_wl_surface, wl_region);
+    wl_region_destroy(wl_region);
+  }
+
+  /* We lay out in buffer pixels, but subsurfaces are placed in surface-local
+   * coordinates, which our own viewport scales our buffer down to. */
+  double to_surface = (double)peekaboo->surface_width /
+                      cairo_image_surface_get_width(cairo_get_target(cr));
+  wl_subsurface_set_position(wm_client->preview_wl_subsurface,
+                             lround(x * to_surface), lround(y * to_surface));
+  wp_viewport_set_destination(
+      wm_client->preview_wp_viewport,
+      MAX(lround(wm_client->preview_thumbnail_width * to_surface), 1),
+      MAX(lround(wm_client->preview_thumbnail_height * to_surface), 1));
+  if (!wm_client->preview_attached) {
+    wl_surface_attach(wm_client->preview_wl_surface,
+                      wm_client->preview_wl_buffer, 0, 0);
+    wl_surface_damage_buffer(wm_client->preview_wl_surface, 0, 0, INT32_MAX,
+                             INT32_MAX);
+    wm_client->preview_attached = true;
+  }
+  /* Subsurfaces are synchronized, so this all shows up with our next
+   * commit, along with the frame we're drawing. */
+  wl_surface_commit(wm_client->preview_wl_surface);
+
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+  cairo_rectangle(cr, x, y, wm_client->preview_thumbnail_width,
+                  wm_client->preview_thumbnail_height);
+  cairo_fill(cr);
   cairo_restore(cr);
 }
 
-void render_wm_client_preview_surface(cairo_t *cr, struct wm_client *wm_client,
-                                      double x, double y, double width,
-                                      double height) {
+/* Unmaps the subsurface of a preview we aren't showing anymore. */
+static void hide_wm_client_subsurface(struct wm_client *wm_client) {
+  if (!wm_client->preview_attached) {
+    return;
+  }
+  wl_surface_attach(wm_client->preview_wl_surface, NULL, 0, 0);
+  wl_surface_commit(wm_client->preview_wl_surface);
+  wm_client->preview_attached = false;
+}
+
+/* Returns whether what was drawn is final, rather than something rough to
+ * show while the thumbnail is being scaled. */
+bool render_wm_client_preview_surface(cairo_t *cr, struct wm_client *wm_client,
+                                      int32_t x, int32_t y, int32_t width,
+                                      int32_t height) {
   cairo_save(cr);
 
-  // Preserve aspect ratio when scaling
-  double scale_x = (double)width / wm_client->width;
-  double scale_y = (double)height / wm_client->height;
-  double scale = fmin(scale_x, scale_y);
+  double scale = thumbnail_scale(wm_client, width, height);
 
-  cairo_surface_t *scaled_surface = surface_cache_get_scaled(
-      wm_client->surface_cache, wm_client->width * scale,
-      wm_client->height * scale);
+  wm_client->preview_box_width = width;
+  wm_client->preview_box_height = height;
+  wm_client->preview_thumbnail_width = wm_client->width * scale;
+  wm_client->preview_thumbnail_height = wm_client->height * scale;
+
+  // Center the surface in the bounding box
+  int32_t thumbnail_x = x + (width - wm_client->preview_thumbnail_width) / 2;
+  int32_t thumbnail_y = y + (height - wm_client->preview_thumbnail_height) / 2;
+
+  struct peekaboo *peekaboo = wm_client->peekaboo;
+  if (peekaboo->subsurface_previews && wm_client->preview_wl_buffer != NULL) {
+    render_wm_client_subsurface(cr, wm_client, thumbnail_x, thumbnail_y);
+    scaled_surface_drawn(wm_client);
+    cairo_restore(cr);
+    return true;
+  }
 
-  // Calculate the offset to center the surface in the bounding box
-  double offset_x = (width - scale * wm_client->width) / 2.0;
-  double offset_y = (height - scale * wm_client->height) / 2.0;
-  cairo_set_source_surface(cr, scaled_surface, x + offset_x, y + offset_y);
+  /* Scaling happens on the worker pool, and we'll be asked for another frame
+   * once it lands. Whatever has to be scaled right here only is while the
+   * frame is within its budget; past that, it's left for the next frame. A
+   * size we haven't seen lately is scaled straight into the frame instead,
+   * which is final right away and cheap enough from the pyramid. */
+  bool may_block = peekaboo->config.frame_budget_ms == 0 ||
+                   (int32_t)(peekaboo->frame_deadline_ms - gettime_ms()) > 0;
+  if (may_block &&
+      surface_cache_wants_direct(wm_client->surface_cache,
+                                 wm_client->preview_thumbnail_width,
+                                 wm_client->preview_thumbnail_height)) {
+    cairo_rectangle(cr, x, y, width, height);
+    cairo_clip(cr);
+    if (render_wm_client_direct(cr, wm_client, thumbnail_x, thumbnail_y)) {
+      scaled_surface_drawn(wm_client);
+      cairo_restore(cr);
+      return true;
+    }
+  }
+  cairo_surface_t *scaled_surface = surface_cache_request_scaled(
+      wm_client->surface_cache, wm_client->preview_thumbnail_width,
+      wm_client->preview_thumbnail_height, false);
+  if (scaled_surface == NULL && may_block) {
+    scaled_surface = surface_cache_request_scaled(
+        wm_client->surface_cache, wm_client->preview_thumbnail_width,
+        wm_client->preview_thumbnail_height, true);
+  }
+  if (scaled_surface == NULL) {
+    if (!may_block) {
+      peekaboo->frame_incomplete = true;
+    }
+    /* Until then, keep showing what we showed before the capture was ready,
+     * or a quick and rough version of the capture if there's nothing. */
+    if (wm_client->disk_thumbnail != NULL) {
+      cairo_restore(cr);
+      render_wm_client_disk_thumbnail(cr, wm_client, x, y, width, height);
+      return false;
+    }
+    if (wm_client->preview_thumbnail_width > 0 &&
+        wm_client->preview_thumbnail_height > 0) {
+      render_wm_client_fallback_surface(cr, wm_client, thumbnail_x,
+                                        thumbnail_y);
+    }
+    cairo_restore(cr);
+    return false;
+  }
+  scaled_surface_drawn(wm_client);
+
+  cairo_set_source_surface(cr, scaled_surface, thumbnail_x, thumbnail_y);
   cairo_paint(cr);
 
   cairo_restore(cr);
+  return true;
 }
 
-void measure_text_themed(cairo_t *cr, PangoLayout *layout,
-                         cairo_surface_t *base_surface, const char *text,
-                         const struct element_style *theme,
+void measure_text_themed(cairo_t *cr, PangoContext *context,
+                         struct text_layout *text_layout, const char *text,
+                         const struct style_plan *plan,
                          /* The rect of the element containing this text */
                          const struct rect *container,
                          /* The rect of this element, including its margin */
@@ -86,6 +292,8 @@ void measure_text_themed(cairo_t *cr, PangoLayout *layout,
                          /* The rect with padding applied */
                          struct rect *out_inner_rect, PangoRectangle *ink_rect,
                          PangoRectangle *logical_rect) {
+  const struct element_style *theme = plan->style;
+
   // Assume the margin rect to be as big as possible for now
   struct rect margin_rect = {
       .x = container->x + theme->margin.left,
@@ -94,19 +302,21 @@ void measure_text_themed(cairo_t *cr, PangoLayout *layout,
       .height = container->height - theme->margin.bottom,
   };
 
-  // Measure the total text width for centering
-  pango_layout_set_text(layout, text, -1);
-  pango_layout_set_width(layout, (margin_rect.width - (theme->padding.left +
-                                                       theme->padding.right)) *
-                                     PANGO_SCALE);
-  pango_layout_get_pixel_extents(layout, ink_rect, logical_rect);
+  // Measure the total text width for centering. Unless the text or the room
+  // it has changed, it's already laid out.
+  text_layout_update(text_layout, context, text,
+                     margin_rect.width - plan->padding_x);
+  if (ink_rect != NULL) {
+    *ink_rect = text_layout->ink_rect;
+  }
+  *logical_rect = text_layout->logical_rect;
 
   // Figure out where to place
-  double background_x, background_y;
+  int32_t background_x, background_y;
   switch (theme->align.horizontal) {
   case ALIGN_CENTER:
     background_x =
-        margin_rect.x + ((margin_rect.width - logical_rect->width) / 2.0);
+        margin_rect.x + ((margin_rect.width - logical_rect->width) / 2);
     break;
   case ALIGN_START:
     background_x = margin_rect.x;
@@ -118,7 +328,7 @@ void measure_text_themed(cairo_t *cr, PangoLayout *layout,
   switch (theme->align.vertical) {
   case ALIGN_CENTER:
     background_y =
-        margin_rect.y + ((margin_rect.height - logical_rect->height) / 2.0);
+        margin_rect.y + ((margin_rect.height - logical_rect->height) / 2);
     break;
   case ALIGN_START:
     background_y = margin_rect.y;
@@ -159,9 +369,10 @@ void measure_text_themed(cairo_t *cr, PangoLayout *layout,
   }
 }
 
-void render_text_themed(cairo_t *cr, PangoLayout *layout,
-                        cairo_surface_t *base_surface, const char *text,
-                        const struct element_style *theme,
+void render_text_themed(cairo_t *cr, PangoContext *context,
+                        struct text_layout *text_layout,
+                        struct nine_slice_cache *nine_slices, const char *text,
+                        const struct style_plan *plan,
                         /* The rect of the element containing this text */
                         const struct rect *container,
                         /* The rect of this element, including its margin */
@@ -183,26 +394,25 @@ void render_text_themed(cairo_t *cr, PangoLayout *layout,
     out_inner_rect = &inner_rect;
   }
 
-  measure_text_themed(cr, layout, base_surface, text, theme, container,
+  measure_text_themed(cr, context, text_layout, text, plan, container,
                       out_margin_rect, out_outer_rect, out_inner_rect, ink_rect,
                       logical_rect);
   // Draw background
-  cairo_set_source_u32(cr, theme->background_color);
-  draw_rounded_rectangle(cr, base_surface, theme, out_outer_rect);
+  draw_rounded_rectangle(cr, nine_slices, plan, out_outer_rect);
 
   // Draw text
   cairo_move_to(cr, out_inner_rect->x, out_inner_rect->y);
-  pango_layout_set_width(layout, out_inner_rect->width * PANGO_SCALE);
-  pango_cairo_update_layout(cr, layout);
-  cairo_set_source_u32(cr, theme->foreground_color);
-  pango_cairo_show_layout(cr, layout);
+  pango_cairo_update_layout(cr, text_layout->layout);
+  cairo_set_source(cr, plan->foreground);
+  pango_cairo_show_layout(cr, text_layout->layout);
 
   cairo_restore(cr);
 }
 
 void render_highlighted_text_themed(
-    cairo_t *cr, PangoLayout *layout, cairo_surface_t *base_surface, char *text,
-    uint32_t hl_len, struct element_style *theme,
+    cairo_t *cr, PangoContext *context, struct text_layout *text_layout,
+    struct nine_slice_cache *nine_slices, char *text, uint32_t hl_len,
+    const struct style_plan *plan,
     /* The rect of the element containing this text */
     struct rect *container,
     /* The rect of this element, including its margin */
@@ -227,31 +437,26 @@ void render_highlighted_text_themed(
     out_inner_rect = &inner_rect;
   }
 
-  measure_text_themed(cr, layout, base_surface, text, theme, container,
+  measure_text_themed(cr, context, text_layout, text, plan, container,
                       out_margin_rect, out_outer_rect, out_inner_rect, ink_rect,
                       logical_rect);
   // Draw background
-  cairo_set_source_u32(cr, theme->background_color);
-  draw_rounded_rectangle(cr, base_surface, theme, out_outer_rect);
+  draw_rounded_rectangle(cr, nine_slices, plan, out_outer_rect);
 
-  // Measure highlighted text
-  PangoRectangle ink_rect_tmp;
-  PangoRectangle logical_rect_tmp;
-  pango_layout_set_text(layout, text, hl_len);
-  pango_layout_get_pixel_extents(layout, &ink_rect_tmp, &logical_rect_tmp);
+  // Split the text where the highlight ends, if it isn't already
+  text_layout_split(text_layout, hl_len);
 
   // Draw highlighted text
   cairo_move_to(cr, out_inner_rect->x, out_inner_rect->y);
-  cairo_set_source_u32(cr, theme->highlight_color);
-  pango_cairo_update_layout(cr, layout);
-  pango_cairo_show_layout(cr, layout);
+  cairo_set_source(cr, plan->highlight);
+  pango_cairo_update_layout(cr, text_layout->highlighted);
+  pango_cairo_show_layout(cr, text_layout->highlighted);
 
   // Draw non-highlighted text
-  pango_layout_set_text(layout, &text[hl_len], -1);
-  cairo_rel_move_to(cr, logical_rect_tmp.width, 0);
-  cairo_set_source_u32(cr, theme->foreground_color);
-  pango_cairo_update_layout(cr, layout);
-  pango_cairo_show_layout(cr, layout);
+  cairo_rel_move_to(cr, text_layout->highlighted_width, 0);
+  cairo_set_source(cr, plan->foreground);
+  pango_cairo_update_layout(cr, text_layout->rest);
+  pango_cairo_show_layout(cr, text_layout->rest);
 
   cairo_restore(cr);
 }
@@ -267,10 +472,13 @@ int count_matching_prefix(const char *str1, const char *str2) {
   return count;
 }
 
-void render_preview(cairo_t *cr, PangoLayout *layout,
-                    cairo_surface_t *base_surface, struct config *config,
-                    struct wm_client *wm_client, double x, double y,
-                    double width, double height) {
+/* The part of a preview that only changes with the layout or the capture: its
+ * box and thumbnail. Returns whether the thumbnail drawn is final. */
+static bool render_preview_base(cairo_t *cr,
+                                struct nine_slice_cache *nine_slices,
+                                const struct render_plan *plan,
+                                struct wm_client *wm_client, int32_t x,
+                                int32_t y, int32_t width, int32_t height) {
 #ifdef DEBUG_RENDERS
   uint32_t start_time_ms = gettime_ms();
 #endif /* DEBUG_RENDERS */
@@ -281,66 +489,210 @@ void render_preview(cairo_t *cr, PangoLayout *layout,
     cairo_save(cr);
     struct rect background_rect = {
         .x = x, .y = y, .width = width, .height = height};
-    draw_rounded_rectangle(cr, base_surface, &config->preview.style,
-                           &background_rect);
+    draw_rounded_rectangle(cr, nine_slices, &plan->preview, &background_rect);
     cairo_restore(cr);
   }
 
   // We should apply padding to (almost) everything past here
-  double padded_x = x + config->preview.style.padding.left;
-  double padded_width = width - (config->preview.style.padding.left +
-                                 config->preview.style.padding.right);
-  double padded_y = y + config->preview.style.padding.top;
-  double padded_height = height - (config->preview.style.padding.top +
-                                   config->preview.style.padding.bottom);
+  int32_t padded_x = x + plan->preview.style->padding.left;
+  int32_t padded_width = width - plan->preview.padding_x;
+  int32_t padded_y = y + plan->preview.style->padding.top;
+  int32_t padded_height = height - plan->preview.padding_y;
+
+  bool complete = true;
+  if (wm_client->ready) {
+    complete = render_wm_client_preview_surface(
+        cr, wm_client, padded_x, padded_y, padded_width, padded_height);
+  } else {
+    render_wm_client_disk_thumbnail(cr, wm_client, padded_x, padded_y,
+                                    padded_width, padded_height);
+  }
+
+  cairo_restore(cr);
+#ifdef DEBUG_RENDERS
+  uint32_t end_time_ms = gettime_ms();
+  log_debug("Rendering one preview for %s took %u ms\n", wm_client->title,
+            end_time_ms - start_time_ms);
+#endif /* DEBUG_RENDERS */
+  return complete;
+}
+
+/* The part of a preview that changes with key presses: its shortcut and
+ * title, drawn dimmed onto a dimmed preview. */
+static void render_preview_overlay(cairo_t *cr, PangoContext *context,
+                                   struct nine_slice_cache *nine_slices,
+                                   const struct render_plan *plan,
+                                   struct wm_client *wm_client, int32_t x,
+                                   int32_t y, int32_t width, int32_t height) {
+  cairo_save(cr);
 
   struct rect container = {
-      .x = padded_x,
-      .y = padded_y,
-      .width = padded_width,
-      .height = padded_height,
+      .x = x + plan->preview.style->padding.left,
+      .y = y + plan->preview.style->padding.top,
+      .width = width - plan->preview.padding_x,
+      .height = height - plan->preview.padding_y,
   };
   PangoRectangle ink_rect;
   PangoRectangle logical_rect;
-
-  if (wm_client->ready) {
-    render_wm_client_preview_surface(cr, wm_client, padded_x, padded_y,
-                                     padded_width, padded_height);
-  }
+  const struct style_plan *shortcut_plan =
+      wm_client->dim ? &plan->dimmed_shortcut : &plan->shortcut;
+  const struct style_plan *title_plan =
+      wm_client->dim ? &plan->dimmed_preview_title : &plan->preview_title;
 
   // Render the key shortcuts
   render_highlighted_text_themed(
-      cr, layout, base_surface, wm_client->shortcut_keys,
-      wm_client->shortcut_keys_highlight_len, &config->shortcut.style,
-      &container, NULL, NULL, NULL, &ink_rect, &logical_rect);
+      cr, context, &wm_client->shortcut_keys_layout, nine_slices,
+      wm_client->shortcut_keys, wm_client->shortcut_keys_highlight_len,
+      shortcut_plan, &container, NULL, NULL, NULL, &ink_rect, &logical_rect);
 
   // Render the title
-  render_text_themed(cr, layout, base_surface, wm_client->title,
-                     &config->preview_title.style, &container, NULL, NULL, NULL,
+  render_text_themed(cr, context, &wm_client->title_layout, nine_slices,
+                     wm_client->title, title_plan, &container, NULL, NULL, NULL,
                      &ink_rect, &logical_rect);
 
-  if (wm_client->dim) {
-    cairo_save(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-    /* 50% transparent black */
-    struct element_style style = {
-        .background_color = 0x7f,
-        .border = config->preview.style.border,
-    };
-    struct rect background_rect = {
-        .x = x, .y = y, .width = width, .height = height};
-    draw_rounded_rectangle(cr, base_surface, &style, &background_rect);
-    cairo_restore(cr);
+  cairo_restore(cr);
+}
+
+/* Puts the node into the dimmed layer, as its base looks with the dim overlay
+ * over it. Past its corners and border, the overlay is plain black over the
+ * box, so most of it is darkened in a single pass over its pixels, and only
+ * the chrome around that is drawn. */
+static void render_dimmed_base(struct scene *scene,
+                               struct nine_slice_cache *nine_slices,
+                               const struct render_plan *plan,
+                               struct scene_node *node) {
+  const struct rect *box = &node->box;
+  int32_t inset = nine_slice_inset(&plan->dim_style);
+  int32_t x0 = MAX(box->x + inset, 0);
+  int32_t y0 = MAX(box->y + inset, 0);
+  int32_t x1 = MIN(box->x + box->width - inset, (int32_t)scene->width);
+  int32_t y1 = MIN(box->y + box->height - inset, (int32_t)scene->height);
+  struct rect inner = {
+      .x = x0,
+      .y = y0,
+      .width = MAX(x1 - x0, 0),
+      .height = MAX(y1 - y0, 0),
+  };
+  scene_dim_node(scene, node, &inner, plan->dim_style.background_color & 0xff);
+
+  cairo_t *cr = scene->dimmed_cairo;
+  cairo_save(cr);
+  cairo_rectangle(cr, node->bounds.x, node->bounds.y, node->bounds.width,
+                  node->bounds.height);
+  if (inner.width > 0 && inner.height > 0) {
+    cairo_rectangle(cr, inner.x, inner.y, inner.width, inner.height);
+    cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+  }
+  cairo_clip(cr);
+  draw_rounded_rectangle(cr, nine_slices, &plan->dim, box);
+  cairo_restore(cr);
+}
+
+static struct layout *calculate_layout(struct config *config,
+                                       uint32_t num_previews,
+                                       uint32_t surface_width,
+                                       uint32_t surface_height) {
+  return calculate_layout_fixed_individual_aspect_ratio(
+      num_previews,
+      surface_width - (config->peekaboo.style.padding.left +
+                       config->peekaboo.style.padding.right),
+      surface_height - (config->peekaboo.style.padding.top +
+                        config->peekaboo.style.padding.bottom));
+}
+
+/* The box a client's thumbnail is fit into, i.e. a preview geometry without
+ * its margin and padding. Every preview in a layout has the same one. */
+static void preview_content_size(struct config *config, struct rect *geometry,
+                                 int32_t *width, int32_t *height) {
+  *width = geometry->width -
+           (config->preview.style.margin.left +
+            config->preview.style.margin.right) -
+           (config->preview.style.padding.left +
+            config->preview.style.padding.right);
+  *height = geometry->height -
+            (config->preview.style.margin.top +
+             config->preview.style.margin.bottom) -
+            (config->preview.style.padding.top +
+             config->preview.style.padding.bottom);
+}
+
+/* Whether the scene's nodes are the clients we're about to show, in the same
+ * order. */
+static bool scene_shows(struct scene *scene, struct wl_list *wm_clients) {
+  uint32_t i = 0;
+  struct wm_client *wm_client;
+  wl_list_for_each(wm_client, wm_clients, link) {
+    if (wm_client->hide) {
+      continue;
+    }
+    if (i == scene->num_nodes || scene->nodes[i].wm_client != wm_client) {
+      return false;
+    }
+    i++;
   }
+  return i == scene->num_nodes;
+}
 
+/* Puts the surface's background back in place of whatever was there. */
+static void clear_rect(cairo_t *cr, const struct render_plan *plan, int32_t x,
+                       int32_t y, int32_t width, int32_t height) {
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source(cr, plan->peekaboo.background);
+  cairo_rectangle(cr, x, y, width, height);
+  cairo_fill(cr);
   cairo_restore(cr);
-#ifdef DEBUG_RENDERS
-  uint32_t end_time_ms = gettime_ms();
-  log_debug("Rendering one preview for %s took %u ms\n", wm_client->title,
-            end_time_ms - start_time_ms);
-#endif /* DEBUG_RENDERS */
 }
 
+/* What of the scene nothing shows through: all of it if the surface's
+ * background is opaque, and otherwise each preview's box short of its
+ * corners, if their background is. With subsurface previews, nothing is: each
+ * thumbnail shows through a hole in its box, from a subsurface below us that
+ * the compositor mustn't cull. */
+static cairo_region_t *opaque_region(struct peekaboo *peekaboo,
+                                     struct scene *scene,
+                                     const struct render_plan *plan) {
+  if (peekaboo->subsurface_previews) {
+    return cairo_region_create();
+  }
+  if (plan->opaque) {
+    return cairo_region_create_rectangle(&(cairo_rectangle_int_t){
+        .width = scene->width,
+        .height = scene->height,
+    });
+  }
+
+  cairo_region_t *opaque = cairo_region_create();
+  if (!plan->preview.opaque) {
+    return opaque;
+  }
+  int32_t radius = plan->preview.style->border.radius;
+  for (uint32_t i = 0; i < scene->num_nodes; i++) {
+    struct rect *box = &scene->nodes[i].box;
+    if (box->width <= 2 * radius || box->height <= 2 * radius) {
+      continue;
+    }
+    cairo_rectangle_int_t across = {
+        .x = box->x,
+        .y = box->y + radius,
+        .width = box->width,
+        .height = box->height - 2 * radius,
+    };
+    cairo_rectangle_int_t down = {
+        .x = box->x + radius,
+        .y = box->y,
+        .width = box->width - 2 * radius,
+        .height = box->height,
+    };
+    cairo_region_union_rectangle(opaque, &across);
+    cairo_region_union_rectangle(opaque, &down);
+  }
+  return opaque;
+}
+
+/* Everything is drawn into the scene, redrawing only the previews whose
+ * capture, thumbnail or key press state changed, and whatever the buffer is
+ * missing of the result copied into it. */
 void render(struct peekaboo *peekaboo, struct surface_buffer *surface_buffer) {
   surface_buffer->state = SURFACE_BUFFER_BUSY;
 #ifdef DEBUG_RENDERS
@@ -348,9 +700,13 @@ void render(struct peekaboo *peekaboo, struct surface_buffer *surface_buffer) {
 #endif /* DEBUG_RENDERS */
 
   cairo_t *cr = surface_buffer->cairo;
-  struct config config = peekaboo->config;
+  const struct render_plan *plan = &peekaboo->render_plan;
+  const struct element_style *surface_style = plan->peekaboo.style;
+  struct scene *scene = &peekaboo->scene;
 
-  cairo_save(cr);
+  peekaboo->frame_deadline_ms = gettime_ms() + peekaboo->config.frame_budget_ms;
+  peekaboo->frame_incomplete = false;
+  scene_begin_frame(scene);
 
   size_t num_previews_to_show = 0;
   {
@@ -361,34 +717,31 @@ void render(struct peekaboo *peekaboo, struct surface_buffer *surface_buffer) {
       }
     }
   }
-  struct layout *layout = calculate_layout_fixed_individual_aspect_ratio(
-      num_previews_to_show,
-      surface_buffer->width - (config.peekaboo.style.padding.left +
-                               config.peekaboo.style.padding.right),
-      surface_buffer->height - (config.peekaboo.style.padding.top +
-                                config.peekaboo.style.padding.bottom));
-
-  double margin_x_size =
-      config.preview.style.margin.left + config.preview.style.margin.right;
-
-  double margin_y_size =
-      config.preview.style.margin.top + config.preview.style.margin.bottom;
-
-  double offset_x = margin_x_size + config.peekaboo.style.padding.left;
-  double offset_y = margin_y_size + config.peekaboo.style.padding.top;
-
-  // Clear the screen
-  {
-    cairo_save(cr);
-    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-    cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
-    cairo_rectangle(cr, config.peekaboo.style.padding.left,
-                    config.peekaboo.style.padding.top,
-                    surface_buffer->width - config.peekaboo.style.padding.right,
-                    surface_buffer->height -
-                        config.peekaboo.style.padding.bottom);
-    cairo_fill(cr);
-    cairo_restore(cr);
+  struct layout *layout = calculate_layout(
+      &peekaboo->config, num_previews_to_show, surface_buffer->width,
+      surface_buffer->height);
+
+  int32_t margin_x_size = plan->preview.margin_x;
+  int32_t margin_y_size = plan->preview.margin_y;
+
+  int32_t offset_x = margin_x_size + surface_style->padding.left;
+  int32_t offset_y = margin_y_size + surface_style->padding.top;
+
+  int32_t spill = plan->preview_spill;
+
+  /* A different set of previews moves every one of them, so that's drawn
+   * from scratch. */
+  bool relayout = scene_resize(scene, surface_buffer->width,
+                               surface_buffer->height);
+  relayout = !scene_shows(scene, &peekaboo->wm_clients) || relayout;
+  if (relayout) {
+    scene_reset_nodes(scene, num_previews_to_show);
+    scene_damage(scene, &(struct rect){.width = scene->width,
+                                       .height = scene->height});
+
+    // Clear the screen
+    clear_rect(scene->base_cairo, plan, 0, 0, scene->width, scene->height);
+    clear_rect(scene->composed_cairo, plan, 0, 0, scene->width, scene->height);
   }
 
   // Render the clients
@@ -396,32 +749,89 @@ void render(struct peekaboo *peekaboo, struct surface_buffer *surface_buffer) {
     struct wm_client *wm_client;
     uint32_t i = 0;
     wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
-      if (!wm_client->hide) {
-        struct rect *preview_geometry = vec_get(layout->preview_geometries, i);
-
-        double x = preview_geometry->x + offset_x;
-        double y = preview_geometry->y + offset_y;
-
-        double width = preview_geometry->width - margin_x_size;
-        double height = preview_geometry->height - margin_y_size;
+      if (wm_client->hide) {
+        if (peekaboo->subsurface_previews) {
+          hide_wm_client_subsurface(wm_client);
+        }
+        continue;
+      }
 
-        render_preview(cr, surface_buffer->pango_layout,
-                       surface_buffer->cairo_surface, &peekaboo->config,
-                       wm_client, x, y, width, height);
+      struct rect *preview_geometry = vec_get(layout->preview_geometries, i);
+      struct scene_node *node = &scene->nodes[i];
+      i++;
+
+      int32_t x = preview_geometry->x + offset_x;
+      int32_t y = preview_geometry->y + offset_y;
+
+      int32_t width = preview_geometry->width - margin_x_size;
+      int32_t height = preview_geometry->height - margin_y_size;
+
+      node->wm_client = wm_client;
+      node->box = (struct rect){
+          .x = x, .y = y, .width = width, .height = height};
+      node->bounds = (struct rect){
+          .x = x - spill,
+          .y = y - spill,
+          .width = width + 2 * spill,
+          .height = height + 2 * spill,
+      };
+
+      if (relayout || !node->base_complete ||
+          node->orig_surface != wm_client->orig_surface) {
+        clear_rect(scene->base_cairo, plan, node->bounds.x, node->bounds.y,
+                   node->bounds.width, node->bounds.height);
+        node->base_complete =
+            render_preview_base(scene->base_cairo, &peekaboo->nine_slices,
+                                plan, wm_client, x, y, width, height);
+        node->orig_surface = wm_client->orig_surface;
+        node->dimmed_ready = false;
+        node->composed = false;
+      }
 
-        i++;
+      if (!node->composed ||
+          node->highlight_len != wm_client->shortcut_keys_highlight_len ||
+          node->dim != wm_client->dim) {
+        if (wm_client->dim && !node->dimmed_ready) {
+          render_dimmed_base(scene, &peekaboo->nine_slices, plan, node);
+          node->dimmed_ready = true;
+        }
+        node->dim = wm_client->dim;
+        scene_restore_node(scene, node);
+        render_preview_overlay(scene->composed_cairo,
+                               peekaboo->surface_buffer_pool.pango_context,
+                               &peekaboo->nine_slices, plan, wm_client, x,
+                               y, width, height);
+        node->composed = true;
+        node->highlight_len = wm_client->shortcut_keys_highlight_len;
       }
     }
   }
 
   layout_destroy(layout);
-  cairo_restore(cr);
+
+  if (relayout) {
+    scene_set_opaque(scene, opaque_region(peekaboo, scene, plan));
+  }
+
+  /* The buffer still holds whatever frame it was last used for, so only what
+   * changed since then has to be copied. */
+  surface_buffer_pool_damage(&peekaboo->surface_buffer_pool, scene->damage);
+  scene_present(scene, cr, surface_buffer->stale);
+  cairo_region_destroy(surface_buffer->stale);
+  surface_buffer->stale = cairo_region_create();
 
 #ifdef DEBUG_RENDERS
   uint32_t end_time_ms = gettime_ms();
   log_debug("Full render took %ums\n", end_time_ms - start_time_ms);
 #endif
-  surface_buffer->state = SURFACE_BUFFER_READY;
+  /* The buffer stays busy until the compositor releases it. */
+}
+
+/* Whether the HIDE filter hides the client once `input` has been typed. */
+static bool hidden_by_input(struct wm_client *wm_client, const char *input,
+                            size_t input_size) {
+  return input_size != 0 &&
+         count_matching_prefix(wm_client->shortcut_keys, input) == 0;
 }
 
 bool recalculate_clients(struct peekaboo *peekaboo) {
@@ -444,7 +854,8 @@ bool recalculate_clients(struct peekaboo *peekaboo) {
     bool new_dim;
     switch (peekaboo->config.client_filter_behavior) {
     case CLIENT_FILTER_BEHAVIOR_HIDE:
-      new_hide = peekaboo->input_size != 0 && matched_prefix_count == 0;
+      new_hide =
+          hidden_by_input(wm_client, peekaboo->input, peekaboo->input_size);
       new_dim = false;
       break;
     case CLIENT_FILTER_BEHAVIOR_DIM:
@@ -471,6 +882,95 @@ bool recalculate_clients(struct peekaboo *peekaboo) {
   return changed;
 }
 
+/* Requests the thumbnails every visible client would need if `input` was
+ * typed, as long as that fits in the budget without evicting anything, see
+ * surface_cache_prescale(). */
+static void prescale_for_input(struct peekaboo *peekaboo, const char *input,
+                               size_t input_size, uint32_t surface_width,
+                               uint32_t surface_height) {
+  uint32_t num_previews = 0;
+  bool same_layout = true;
+  struct wm_client *wm_client;
+  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
+    bool hide = hidden_by_input(wm_client, input, input_size);
+    if (!hide) {
+      num_previews++;
+    }
+    same_layout = same_layout && hide == wm_client->hide;
+  }
+  /* Whatever the current layout needs has been requested by render(). */
+  if (num_previews == 0 || same_layout) {
+    return;
+  }
+
+  struct layout *layout = calculate_layout(&peekaboo->config, num_previews,
+                                           surface_width, surface_height);
+  int32_t box_width, box_height;
+  preview_content_size(&peekaboo->config,
+                       vec_get(layout->preview_geometries, 0), &box_width,
+                       &box_height);
+  layout_destroy(layout);
+
+  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
+    if (!wm_client->ready || hidden_by_input(wm_client, input, input_size)) {
+      continue;
+    }
+    double scale = thumbnail_scale(wm_client, box_width, box_height);
+    int thumbnail_width = wm_client->width * scale;
+    int thumbnail_height = wm_client->height * scale;
+    /* Anything that would be scaled on the main thread is left for when it's
+     * actually shown. */
+    if (!surface_cache_prescale(wm_client->surface_cache, thumbnail_width,
+                                thumbnail_height)) {
+      return;
+    }
+  }
+}
+
+void prescale_candidate_layouts(struct peekaboo *peekaboo,
+                                uint32_t surface_width,
+                                uint32_t surface_height) {
+  if (peekaboo->config.client_filter_behavior != CLIENT_FILTER_BEHAVIOR_HIDE ||
+      peekaboo->subsurface_previews ||
+      peekaboo->input_size + 1 >= MAX_INPUT_LENGTH) {
+    return;
+  }
+
+  char input[MAX_INPUT_LENGTH];
+  memcpy(input, peekaboo->input, peekaboo->input_size);
+  size_t input_size = peekaboo->input_size;
+
+  /* Backspace. */
+  if (input_size > 0) {
+    input[input_size - 1] = '\0';
+    prescale_for_input(peekaboo, input, input_size - 1, surface_width,
+                       surface_height);
+  }
+
+  /* Only keys that continue some client's shortcut can change which clients
+   * are shown; anything else just hides everything. Most of them won't change
+   * the layout at all, which prescale_for_input() sees for itself. */
+  bool tried[256] = {false};
+  struct wm_client *wm_client;
+  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
+    if (strlen(wm_client->shortcut_keys) <= input_size ||
+        strncmp(wm_client->shortcut_keys, peekaboo->input, input_size) != 0) {
+      continue;
+    }
+    unsigned char next = wm_client->shortcut_keys[input_size];
+    if (tried[next]) {
+      continue;
+    }
+    tried[next] = true;
+
+    memcpy(input, peekaboo->input, input_size);
+    input[input_size] = next;
+    input[input_size + 1] = '\0';
+    prescale_for_input(peekaboo, input, input_size + 1, surface_width,
+                       surface_height);
+  }
+}
+
 bool handle_key(struct peekaboo *peekaboo, xkb_keysym_t keysym, char ch) {
 
   switch (keysym) {
@@ -6,6 +6,13 @@
 
 void render(struct peekaboo *peekaboo, struct surface_buffer *surface_buffer);
 
+/* With the HIDE filter, every key press changes the layout and with it the
+ * size of every thumbnail. Meant to be called between key presses, this
+ * queues the scaling for the layouts the next key press could lead to. */
+void prescale_candidate_layouts(struct peekaboo *peekaboo,
+                                uint32_t surface_width,
+                                uint32_t surface_height);
+
 bool handle_key(struct peekaboo *peekaboo, uint32_t key, char character);
 
 #endif /* _PREVIEW_H_ */
@@ -0,0 +1,229 @@
+#include "qoi.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
+/* Guards against absurd allocations from corrupted files. */
+#define QOI_MAX_PIXELS (16384u * 16384u)
+
+static const uint8_t qoi_magic[4] = {'q', 'o', 'i', 'f'};
+static const uint8_t qoi_padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+union qoi_rgba {
+  struct {
+    uint8_t r, g, b, a;
+  } rgba;
+  uint32_t v;
+};
+
+static inline uint32_t qoi_hash(union qoi_rgba px) {
+  return (px.rgba.r * 3 + px.rgba.g * 5 + px.rgba.b * 7 + px.rgba.a * 11) %
+         64;
+}
+
+static inline union qoi_rgba qoi_from_argb32(uint32_t argb) {
+  union qoi_rgba px;
+  px.rgba.r = argb >> 16;
+  px.rgba.g = argb >> 8;
+  px.rgba.b = argb;
+  px.rgba.a = argb >> 24;
+  return px;
+}
+
+static inline uint32_t qoi_to_argb32(union qoi_rgba px) {
+  return (uint32_t)px.rgba.a << 24 | (uint32_t)px.rgba.r << 16 |
+         (uint32_t)px.rgba.g << 8 | px.rgba.b;
+}
+
+static void write_u32_be(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t read_u32_be(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+uint8_t *qoi_encode(const uint8_t *pixels, uint32_t width, uint32_t height,
+                    uint32_t stride, size_t *out_size) {
+  if (width == 0 || height == 0 || (uint64_t)width * height > QOI_MAX_PIXELS) {
+    return NULL;
+  }
+
+  size_t max_size = (size_t)width * height * 5 + QOI_HEADER_SIZE +
+                    QOI_PADDING_SIZE;
+  uint8_t *out = malloc(max_size);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  size_t p = 0;
+  memcpy(&out[p], qoi_magic, sizeof(qoi_magic));
+  p += sizeof(qoi_magic);
+  write_u32_be(&out[p], width);
+  p += 4;
+  write_u32_be(&out[p], height);
+  p += 4;
+  out[p++] = 4; /* channels */
+  out[p++] = 0; /* colorspace */
+
+  union qoi_rgba index[64] = {0};
+  union qoi_rgba prev = {.rgba = {0, 0, 0, 255}};
+  uint32_t run = 0;
+
+  for (uint32_t y = 0; y < height; y++) {
+    const uint32_t *row = (const uint32_t *)(pixels + (size_t)y * stride);
+    for (uint32_t x = 0; x < width; x++) {
+      union qoi_rgba px = qoi_from_argb32(row[x]);
+      bool last = y == height - 1 && x == width - 1;
+
+      if (px.v == prev.v) {
+        run++;
+        if (run == 62 || last) {
+          out[p++] = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        out[p++] = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      uint32_t hash = qoi_hash(px);
+      if (index[hash].v == px.v) {
+        out[p++] = QOI_OP_INDEX | hash;
+      } else {
+        index[hash] = px;
+        if (px.rgba.a == prev.rgba.a) {
+          int8_t vr = px.rgba.r - prev.rgba.r;
+          int8_t vg = px.rgba.g - prev.rgba.g;
+          int8_t vb = px.rgba.b - prev.rgba.b;
+          int8_t vg_r = vr - vg;
+          int8_t vg_b = vb - vg;
+
+          if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+            out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+          } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                     vg_b > -9 && vg_b < 8) {
+            out[p++] = QOI_OP_LUMA | (vg + 32);
+            out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+          } else {
+            out[p++] = QOI_OP_RGB;
+            out[p++] = px.rgba.r;
+            out[p++] = px.rgba.g;
+            out[p++] = px.rgba.b;
+          }
+        } else {
+          out[p++] = QOI_OP_RGBA;
+          out[p++] = px.rgba.r;
+          out[p++] = px.rgba.g;
+          out[p++] = px.rgba.b;
+          out[p++] = px.rgba.a;
+        }
+      }
+      prev = px;
+    }
+  }
+
+  memcpy(&out[p], qoi_padding, sizeof(qoi_padding));
+  p += sizeof(qoi_padding);
+
+  *out_size = p;
+  return out;
+}
+
+bool qoi_read_header(const uint8_t *data, size_t size, uint32_t *width,
+                     uint32_t *height) {
+  if (size < QOI_HEADER_SIZE + QOI_PADDING_SIZE ||
+      memcmp(data, qoi_magic, sizeof(qoi_magic)) != 0) {
+    return false;
+  }
+  *width = read_u32_be(&data[4]);
+  *height = read_u32_be(&data[8]);
+  return *width != 0 && *height != 0 &&
+         (uint64_t)*width * *height <= QOI_MAX_PIXELS;
+}
+
+bool qoi_decode(const uint8_t *data, size_t size, uint8_t *pixels,
+                uint32_t width, uint32_t height, uint32_t stride) {
+  uint32_t header_width, header_height;
+  if (!qoi_read_header(data, size, &header_width, &header_height) ||
+      header_width != width || header_height != height) {
+    return false;
+  }
+
+  union qoi_rgba index[64] = {0};
+  union qoi_rgba px = {.rgba = {0, 0, 0, 255}};
+  uint32_t run = 0;
+  size_t p = QOI_HEADER_SIZE;
+  size_t chunks_end = size - QOI_PADDING_SIZE;
+
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t *row = (uint32_t *)(pixels + (size_t)y * stride);
+    for (uint32_t x = 0; x < width; x++) {
+      if (run > 0) {
+        run--;
+      } else if (p < chunks_end) {
+        uint8_t b1 = data[p++];
+
+        if (b1 == QOI_OP_RGB) {
+          if (p + 3 > chunks_end) {
+            return false;
+          }
+          px.rgba.r = data[p++];
+          px.rgba.g = data[p++];
+          px.rgba.b = data[p++];
+        } else if (b1 == QOI_OP_RGBA) {
+          if (p + 4 > chunks_end) {
+            return false;
+          }
+          px.rgba.r = data[p++];
+          px.rgba.g = data[p++];
+          px.rgba.b = data[p++];
+          px.rgba.a = data[p++];
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+          px = index[b1];
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+          px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+          px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+          px.rgba.b += (b1 & 0x03) - 2;
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+          if (p + 1 > chunks_end) {
+            return false;
+          }
+          uint8_t b2 = data[p++];
+          int vg = (b1 & 0x3f) - 32;
+          px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+          px.rgba.g += vg;
+          px.rgba.b += vg - 8 + (b2 & 0x0f);
+        } else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+          run = b1 & 0x3f;
+        }
+
+        index[qoi_hash(px)] = px;
+      } else {
+        /* Ran out of data before filling the image. */
+        return false;
+      }
+
+      row[x] = qoi_to_argb32(px);
+    }
+  }
+
+  return true;
+}
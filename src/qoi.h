@@ -0,0 +1,31 @@
+#ifndef _QOI_H_
+#define _QOI_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A minimal implementation of the "Quite OK Image" format
+ * (https://qoiformat.org/qoi-specification.pdf). It's several times faster
+ * than PNG to encode and decode while compressing screenshots reasonably well,
+ * which is all we need for caching thumbnails on disk.
+ *
+ * Pixels are taken and returned as 32-bit 0xAARRGGBB words, i.e. the in-memory
+ * layout of CAIRO_FORMAT_ARGB32. Premultiplication is not undone: whatever
+ * was encoded is exactly what's decoded. */
+
+/* Encodes the pixels into a newly allocated buffer and writes its size into
+ * *out_size. Returns NULL on failure. */
+uint8_t *qoi_encode(const uint8_t *pixels, uint32_t width, uint32_t height,
+                    uint32_t stride, size_t *out_size);
+
+/* Reads the dimensions from the header of an encoded image. */
+bool qoi_read_header(const uint8_t *data, size_t size, uint32_t *width,
+                     uint32_t *height);
+
+/* Decodes into `pixels`, which must be large enough to hold `height` rows of
+ * `stride` bytes. The dimensions must match the ones in the header. */
+bool qoi_decode(const uint8_t *data, size_t size, uint8_t *pixels,
+                uint32_t width, uint32_t height, uint32_t stride);
+
+#endif /* _QOI_H_ */
@@ -0,0 +1,94 @@
+#include "render_plan.h"
+#include <string.h>
+
+static cairo_pattern_t *create_pattern(color_t color) {
+  return cairo_pattern_create_rgba(
+      (color >> 24 & 0xff) / 255.0, (color >> 16 & 0xff) / 255.0,
+      (color >> 8 & 0xff) / 255.0, (color & 0xff) / 255.0);
+}
+
+/* Drawing in `color` and then darkening everything with black at `alpha` is
+ * the same as darkening first and drawing in the color this returns: the same
+ * color scaled down, just as opaque. */
+static color_t darken_color(color_t color, uint8_t alpha) {
+  uint32_t keep = 255 - alpha;
+  color_t darkened = color & 0xff;
+  for (int shift = 8; shift < 32; shift += 8) {
+    uint32_t t = (color >> shift & 0xff) * keep + 0x80;
+    darkened |= ((t + (t >> 8)) >> 8) << shift;
+  }
+  return darkened;
+}
+
+static void darken_style(struct element_style *darkened,
+                         const struct element_style *style, uint8_t alpha) {
+  *darkened = *style;
+  darkened->foreground_color = darken_color(style->foreground_color, alpha);
+  darkened->highlight_color = darken_color(style->highlight_color, alpha);
+  darkened->background_color = darken_color(style->background_color, alpha);
+  darkened->border.color = darken_color(style->border.color, alpha);
+}
+
+static void compile_style(struct style_plan *plan,
+                          const struct element_style *style) {
+  plan->style = style;
+  plan->foreground = create_pattern(style->foreground_color);
+  plan->highlight = create_pattern(style->highlight_color);
+  plan->background = create_pattern(style->background_color);
+  plan->border = create_pattern(style->border.color);
+
+  plan->has_background = (style->background_color & 0xff) != 0;
+  plan->has_border =
+      style->border.width != 0 && (style->border.color & 0xff) != 0;
+  plan->square = style->border.radius == 0;
+  plan->opaque = (style->background_color & 0xff) == 0xff;
+
+  plan->padding_x = style->padding.left + style->padding.right;
+  plan->padding_y = style->padding.top + style->padding.bottom;
+  plan->margin_x = style->margin.left + style->margin.right;
+  plan->margin_y = style->margin.top + style->margin.bottom;
+}
+
+static void destroy_style(struct style_plan *plan) {
+  cairo_pattern_destroy(plan->foreground);
+  cairo_pattern_destroy(plan->highlight);
+  cairo_pattern_destroy(plan->background);
+  cairo_pattern_destroy(plan->border);
+}
+
+void render_plan_compile(struct render_plan *plan,
+                         const struct config *config) {
+  memset(plan, 0, sizeof(struct render_plan));
+  compile_style(&plan->peekaboo, &config->peekaboo.style);
+  compile_style(&plan->preview, &config->preview.style);
+  compile_style(&plan->preview_title, &config->preview_title.style);
+  compile_style(&plan->shortcut, &config->shortcut.style);
+
+  plan->dim_style = (struct element_style){
+      .background_color = 0x7f,
+      .border = config->preview.style.border,
+  };
+  compile_style(&plan->dim, &plan->dim_style);
+  uint8_t dim_alpha = plan->dim_style.background_color & 0xff;
+  darken_style(&plan->dimmed_preview_title_style,
+               &config->preview_title.style, dim_alpha);
+  compile_style(&plan->dimmed_preview_title,
+                &plan->dimmed_preview_title_style);
+  darken_style(&plan->dimmed_shortcut_style, &config->shortcut.style,
+               dim_alpha);
+  compile_style(&plan->dimmed_shortcut, &plan->dimmed_shortcut_style);
+
+  plan->preview_spill = (config->preview.style.border.width + 1) / 2 + 1;
+  plan->opaque = plan->peekaboo.opaque;
+}
+
+void render_plan_destroy(struct render_plan *plan) {
+  destroy_style(&plan->peekaboo);
+  destroy_style(&plan->preview);
+  destroy_style(&plan->preview_title);
+  destroy_style(&plan->shortcut);
+  destroy_style(&plan->dim);
+  destroy_style(&plan->dimmed_preview_title);
+  destroy_style(&plan->dimmed_shortcut);
+  memset(plan, 0, sizeof(struct render_plan));
+}
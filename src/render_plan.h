@@ -0,0 +1,66 @@
+#ifndef _RENDER_PLAN_H_
+#define _RENDER_PLAN_H_
+
+#include "config.h"
+#include "styles.h"
+#include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The config as render() uses it, worked out once when it's loaded instead of
+ * on every frame: colors as ready-made cairo sources, paddings and margins
+ * summed up, and which parts of a box actually show. */
+
+struct style_plan {
+  const struct element_style *style;
+
+  cairo_pattern_t            *foreground;
+  cairo_pattern_t            *highlight;
+  cairo_pattern_t            *background;
+  cairo_pattern_t            *border;
+
+  /* Whether there's any background or border to draw at all, and whether
+   * boxes of this style are plain rectangles. */
+  bool                       has_background;
+  bool                       has_border;
+  bool                       square;
+  /* Whether nothing shows through the background. */
+  bool                       opaque;
+
+  /* Both sides' padding and margin together. */
+  int32_t                    padding_x;
+  int32_t                    padding_y;
+  int32_t                    margin_x;
+  int32_t                    margin_y;
+};
+
+struct render_plan {
+  struct style_plan    peekaboo;
+  struct style_plan    preview;
+  struct style_plan    preview_title;
+  struct style_plan    shortcut;
+
+  /* What's drawn over dimmed previews: 50% transparent black, in the
+   * preview's shape. */
+  struct element_style dim_style;
+  struct style_plan    dim;
+  /* Titles and shortcuts as they look under that, so they can be drawn onto
+   * an already dimmed preview. */
+  struct element_style dimmed_preview_title_style;
+  struct style_plan    dimmed_preview_title;
+  struct element_style dimmed_shortcut_style;
+  struct style_plan    dimmed_shortcut;
+
+  /* How far a preview's border, and its antialiasing, reach past its box. */
+  int32_t              preview_spill;
+
+  /* Whether the whole surface is opaque, which it is when its background
+   * is, since everything else is drawn over it. */
+  bool                 opaque;
+};
+
+/* `config` must outlive the plan. */
+void render_plan_compile(struct render_plan *plan, const struct config *config);
+void render_plan_destroy(struct render_plan *plan);
+
+#endif /* _RENDER_PLAN_H_ */
@@ -0,0 +1,419 @@
+#include "scale.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SCALE_X86
+#include <immintrin.h>
+#endif
+
+/* The image is scaled vertically first, into a row of 16-bit intermediates,
+ * and that row is then scaled horizontally. Both passes are a weighted sum of
+ * a handful of taps per output, which maps neatly onto pmaddwd: interleave two
+ * taps' 16-bit values and multiply-add them with their two weights at once.
+ *
+ * The weights along each axis are fixed point with SCALE_WEIGHT_BITS
+ * fractional bits and always add up to exactly 1. The intermediate row keeps
+ * SCALE_INTERMEDIATE_BITS of extra precision, which is as much as fits in an
+ * int16 (255 << 7 = 32640). */
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_INTERMEDIATE_BITS 7
+#define SCALE_ROWS_SHIFT (SCALE_WEIGHT_BITS - SCALE_INTERMEDIATE_BITS)
+#define SCALE_COLUMNS_SHIFT (SCALE_WEIGHT_BITS + SCALE_INTERMEDIATE_BITS)
+
+/* Which source pixels contribute to each destination pixel along one axis,
+ * and how much. Destination pixel `i` reads `counts[i]` pixels from
+ * `starts[i]` on, weighed by `weights[i * max_taps]` and onwards. Counts are
+ * always even so the kernels can work on pairs of taps; padding taps have a
+ * weight of 0. */
+struct scale_taps {
+  uint32_t max_taps;
+  uint32_t *starts;
+  uint32_t *counts;
+  int16_t  *weights;
+};
+
+static void scale_taps_finish(struct scale_taps *taps) {
+  free(taps->starts);
+  free(taps->counts);
+  free(taps->weights);
+}
+
+static bool scale_taps_init(struct scale_taps *taps, uint32_t src_len,
+                            uint32_t dst_len) {
+  double ratio = (double)src_len / dst_len;
+  /* A span `ratio` pixels long touches at most ceil(ratio) + 1 pixels. */
+  uint32_t max_taps = (uint32_t)ceil(ratio) + 1;
+  max_taps += max_taps & 1;
+
+  taps->max_taps = max_taps;
+  taps->starts = malloc(dst_len * sizeof(uint32_t));
+  taps->counts = malloc(dst_len * sizeof(uint32_t));
+  taps->weights = calloc((size_t)dst_len * max_taps, sizeof(int16_t));
+  if (taps->starts == NULL || taps->counts == NULL || taps->weights == NULL) {
+    scale_taps_finish(taps);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < dst_len; i++) {
+    double lo = i * ratio;
+    double hi = fmin((i + 1) * ratio, src_len);
+    uint32_t start = (uint32_t)lo;
+    int16_t *weights = &taps->weights[(size_t)i * max_taps];
+
+    uint32_t count = 0;
+    int32_t sum = 0;
+    uint32_t largest = 0;
+    while (count < max_taps && start + count < src_len) {
+      double cover =
+          fmin(start + count + 1, hi) - fmax((double)start + count, lo);
+      if (cover <= 0) {
+        break;
+      }
+      weights[count] =
+          (int16_t)lround(cover / ratio * (1 << SCALE_WEIGHT_BITS));
+      sum += weights[count];
+      if (weights[count] > weights[largest]) {
+        largest = count;
+      }
+      count++;
+    }
+    /* Rounding leaves us a little off. Put the difference on the biggest tap,
+     * where it matters least, so flat colors stay exactly the same. */
+    weights[largest] += (1 << SCALE_WEIGHT_BITS) - sum;
+
+    taps->starts[i] = start;
+    taps->counts[i] = count + (count & 1);
+  }
+  return true;
+}
+
+// Scalar {{{
+static void scale_rows_range_scalar(int16_t *out, const uint8_t *const *rows,
+                                    const int16_t *weights, uint32_t num_taps,
+                                    uint32_t from, uint32_t len) {
+  for (uint32_t x = from; x < len; x++) {
+    int32_t acc = 1 << (SCALE_ROWS_SHIFT - 1);
+    for (uint32_t t = 0; t < num_taps; t++) {
+      acc += rows[t][x] * weights[t];
+    }
+    out[x] = acc >> SCALE_ROWS_SHIFT;
+  }
+}
+
+static void scale_rows_scalar(int16_t *out, const uint8_t *const *rows,
+                              const int16_t *weights, uint32_t num_taps,
+                              uint32_t len) {
+  scale_rows_range_scalar(out, rows, weights, num_taps, 0, len);
+}
+
+static void scale_columns_scalar(uint8_t *out, const int16_t *row,
+                                 const struct scale_taps *taps,
+                                 uint32_t dst_width) {
+  for (uint32_t x = 0; x < dst_width; x++) {
+    const int16_t *weights = &taps->weights[(size_t)x * taps->max_taps];
+    const int16_t *px = row + taps->starts[x] * 4;
+    for (int c = 0; c < 4; c++) {
+      int32_t acc = 1 << (SCALE_COLUMNS_SHIFT - 1);
+      for (uint32_t t = 0; t < taps->counts[x]; t++) {
+        acc += px[t * 4 + c] * weights[t];
+      }
+      out[x * 4 + c] = acc >> SCALE_COLUMNS_SHIFT;
+    }
+  }
+}
+// }}}
+
+#ifdef SCALE_X86
+// SSE2 {{{
+static void scale_rows_sse2(int16_t *out, const uint8_t *const *rows,
+                            const int16_t *weights, uint32_t num_taps,
+                            uint32_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (SCALE_ROWS_SHIFT - 1));
+
+  uint32_t x = 0;
+  for (; x + 16 <= len; x += 16) {
+    __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+    for (uint32_t t = 0; t < num_taps; t += 2) {
+      int32_t weight_pair;
+      memcpy(&weight_pair, &weights[t], sizeof(weight_pair));
+      __m128i w = _mm_set1_epi32(weight_pair);
+
+      __m128i a = _mm_loadu_si128((const __m128i *)(rows[t] + x));
+      __m128i b = _mm_loadu_si128((const __m128i *)(rows[t + 1] + x));
+      __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+      __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+      __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+      __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+      acc0 = _mm_add_epi32(acc0,
+                           _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+      acc1 = _mm_add_epi32(acc1,
+                           _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+      acc2 = _mm_add_epi32(acc2,
+                           _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+      acc3 = _mm_add_epi32(acc3,
+                           _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+    }
+    acc0 = _mm_srai_epi32(acc0, SCALE_ROWS_SHIFT);
+    acc1 = _mm_srai_epi32(acc1, SCALE_ROWS_SHIFT);
+    acc2 = _mm_srai_epi32(acc2, SCALE_ROWS_SHIFT);
+    acc3 = _mm_srai_epi32(acc3, SCALE_ROWS_SHIFT);
+    _mm_storeu_si128((__m128i *)(out + x), _mm_packs_epi32(acc0, acc1));
+    _mm_storeu_si128((__m128i *)(out + x + 8), _mm_packs_epi32(acc2, acc3));
+  }
+  scale_rows_range_scalar(out, rows, weights, num_taps, x, len);
+}
+
+static void scale_columns_range_sse2(uint8_t *out, const int16_t *row,
+                                     const struct scale_taps *taps,
+                                     uint32_t from, uint32_t dst_width) {
+  const __m128i round = _mm_set1_epi32(1 << (SCALE_COLUMNS_SHIFT - 1));
+
+  for (uint32_t x = from; x < dst_width; x++) {
+    const int16_t *weights = &taps->weights[(size_t)x * taps->max_taps];
+    const int16_t *px = row + taps->starts[x] * 4;
+    __m128i acc = round;
+    for (uint32_t t = 0; t < taps->counts[x]; t += 2, px += 8) {
+      int32_t weight_pair;
+      memcpy(&weight_pair, &weights[t], sizeof(weight_pair));
+      /* Two pixels, c0 c1 c2 c3 c0' c1' c2' c3', into c0 c0' c1 c1' ... */
+      __m128i pair = _mm_loadu_si128((const __m128i *)px);
+      __m128i interleaved = _mm_unpacklo_epi16(pair, _mm_srli_si128(pair, 8));
+      acc = _mm_add_epi32(
+          acc, _mm_madd_epi16(interleaved, _mm_set1_epi32(weight_pair)));
+    }
+    acc = _mm_srai_epi32(acc, SCALE_COLUMNS_SHIFT);
+    acc = _mm_packs_epi32(acc, acc);
+    acc = _mm_packus_epi16(acc, acc);
+    uint32_t pixel = _mm_cvtsi128_si32(acc);
+    memcpy(out + x * 4, &pixel, sizeof(pixel));
+  }
+}
+
+static void scale_columns_sse2(uint8_t *out, const int16_t *row,
+                               const struct scale_taps *taps,
+                               uint32_t dst_width) {
+  scale_columns_range_sse2(out, row, taps, 0, dst_width);
+}
+// }}}
+
+// AVX2 {{{
+/* Same as the SSE2 version, but 32 bytes at a time. Unpacking and packing
+ * both work within 128-bit lanes, so only the final store needs to put the
+ * lanes back in order. */
+__attribute__((target("avx2"))) static void
+scale_rows_avx2(int16_t *out, const uint8_t *const *rows,
+                const int16_t *weights, uint32_t num_taps, uint32_t len) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(1 << (SCALE_ROWS_SHIFT - 1));
+
+  uint32_t x = 0;
+  for (; x + 32 <= len; x += 32) {
+    __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+    for (uint32_t t = 0; t < num_taps; t += 2) {
+      int32_t weight_pair;
+      memcpy(&weight_pair, &weights[t], sizeof(weight_pair));
+      __m256i w = _mm256_set1_epi32(weight_pair);
+
+      __m256i a = _mm256_loadu_si256((const __m256i *)(rows[t] + x));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(rows[t + 1] + x));
+      __m256i a_lo = _mm256_unpacklo_epi8(a, zero);
+      __m256i a_hi = _mm256_unpackhi_epi8(a, zero);
+      __m256i b_lo = _mm256_unpacklo_epi8(b, zero);
+      __m256i b_hi = _mm256_unpackhi_epi8(b, zero);
+      acc0 = _mm256_add_epi32(
+          acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_lo, b_lo), w));
+      acc1 = _mm256_add_epi32(
+          acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_lo, b_lo), w));
+      acc2 = _mm256_add_epi32(
+          acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_hi, b_hi), w));
+      acc3 = _mm256_add_epi32(
+          acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_hi, b_hi), w));
+    }
+    __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(acc0, SCALE_ROWS_SHIFT),
+                                    _mm256_srai_epi32(acc1, SCALE_ROWS_SHIFT));
+    __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(acc2, SCALE_ROWS_SHIFT),
+                                    _mm256_srai_epi32(acc3, SCALE_ROWS_SHIFT));
+    _mm256_storeu_si256((__m256i *)(out + x),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + x + 16),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+  scale_rows_range_scalar(out, rows, weights, num_taps, x, len);
+}
+
+/* Two destination pixels at a time, one per lane. Their tap counts may
+ * differ, so this runs through all max_taps of them; the extra taps have no
+ * weight and the row is padded for them. */
+__attribute__((target("avx2"))) static void
+scale_columns_avx2(uint8_t *out, const int16_t *row,
+                   const struct scale_taps *taps, uint32_t dst_width) {
+  const __m256i round = _mm256_set1_epi32(1 << (SCALE_COLUMNS_SHIFT - 1));
+  const uint32_t max_taps = taps->max_taps;
+
+  uint32_t x = 0;
+  for (; x + 2 <= dst_width; x += 2) {
+    const int16_t *weights_a = &taps->weights[(size_t)x * max_taps];
+    const int16_t *weights_b = weights_a + max_taps;
+    const int16_t *px_a = row + taps->starts[x] * 4;
+    const int16_t *px_b = row + taps->starts[x + 1] * 4;
+    __m256i acc = round;
+    for (uint32_t t = 0; t < max_taps; t += 2) {
+      int32_t weight_pair_a, weight_pair_b;
+      memcpy(&weight_pair_a, &weights_a[t], sizeof(weight_pair_a));
+      memcpy(&weight_pair_b, &weights_b[t], sizeof(weight_pair_b));
+      __m256i w = _mm256_setr_epi32(weight_pair_a, weight_pair_a,
+                                    weight_pair_a, weight_pair_a, weight_pair_b,
+                                    weight_pair_b, weight_pair_b, weight_pair_b);
+
+      __m256i pairs = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(
+              _mm_loadu_si128((const __m128i *)(px_a + t * 4))),
+          _mm_loadu_si128((const __m128i *)(px_b + t * 4)), 1);
+      __m256i interleaved =
+          _mm256_unpacklo_epi16(pairs, _mm256_srli_si256(pairs, 8));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(interleaved, w));
+    }
+    acc = _mm256_srai_epi32(acc, SCALE_COLUMNS_SHIFT);
+    acc = _mm256_packs_epi32(acc, acc);
+    acc = _mm256_packus_epi16(acc, acc);
+    uint32_t pixel_a = _mm256_cvtsi256_si32(acc);
+    uint32_t pixel_b = _mm_cvtsi128_si32(_mm256_extracti128_si256(acc, 1));
+    memcpy(out + x * 4, &pixel_a, sizeof(pixel_a));
+    memcpy(out + x * 4 + 4, &pixel_b, sizeof(pixel_b));
+  }
+  scale_columns_range_sse2(out, row, taps, x, dst_width);
+}
+// }}}
+#endif /* SCALE_X86 */
+
+/* Premultiplied OVER: dst = src + dst * (1 - src alpha). */
+static void blend_over(uint8_t *dst, const uint8_t *src, uint32_t width) {
+  for (uint32_t x = 0; x < width; x++, src += 4, dst += 4) {
+    uint32_t alpha = src[3];
+    if (alpha == 0xff) {
+      memcpy(dst, src, 4);
+    } else if (alpha != 0) {
+      for (int c = 0; c < 4; c++) {
+        uint32_t t = dst[c] * (0xff - alpha) + 0x80;
+        dst[c] = src[c] + ((t + (t >> 8)) >> 8);
+      }
+    }
+  }
+}
+
+static bool scale_area_average_clipped(
+    const void *src, uint32_t src_width, uint32_t src_height,
+    uint32_t src_stride, uint32_t dst_width, uint32_t dst_height,
+    uint32_t clip_x, uint32_t clip_y, uint32_t clip_width,
+    uint32_t clip_height, void *dst, uint32_t dst_stride, bool over) {
+  if (dst_width == 0 || dst_height == 0 || dst_width > src_width ||
+      dst_height > src_height || clip_x + clip_width > dst_width ||
+      clip_y + clip_height > dst_height) {
+    return false;
+  }
+  if (clip_width == 0 || clip_height == 0) {
+    return true;
+  }
+
+  void (*scale_rows)(int16_t *, const uint8_t *const *, const int16_t *,
+                     uint32_t, uint32_t) = scale_rows_scalar;
+  void (*scale_columns)(uint8_t *, const int16_t *, const struct scale_taps *,
+                        uint32_t) = scale_columns_scalar;
+#ifdef SCALE_X86
+  scale_rows = scale_rows_sse2;
+  scale_columns = scale_columns_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    scale_rows = scale_rows_avx2;
+    scale_columns = scale_columns_avx2;
+  }
+#endif
+
+  struct scale_taps x_taps, y_taps;
+  if (!scale_taps_init(&x_taps, src_width, dst_width)) {
+    return false;
+  }
+  if (!scale_taps_init(&y_taps, src_height, dst_height)) {
+    scale_taps_finish(&x_taps);
+    return false;
+  }
+
+  /* Only the source columns the clipped destination columns read from need
+   * the vertical pass. */
+  uint32_t last_x = clip_x + clip_width - 1;
+  uint32_t row_from = x_taps.starts[clip_x];
+  uint32_t row_to = x_taps.starts[last_x] + x_taps.counts[last_x];
+  if (row_to > src_width) {
+    row_to = src_width;
+  }
+  struct scale_taps clipped_x_taps = {
+      .max_taps = x_taps.max_taps,
+      .starts = x_taps.starts + clip_x,
+      .counts = x_taps.counts + clip_x,
+      .weights = x_taps.weights + (size_t)clip_x * x_taps.max_taps,
+  };
+
+  /* The horizontal pass may read up to max_taps padding pixels past the end
+   * of the row, which must be zero. */
+  int16_t *row = calloc((size_t)(src_width + x_taps.max_taps) * 4,
+                        sizeof(int16_t));
+  const uint8_t **rows = malloc(y_taps.max_taps * sizeof(uint8_t *));
+  uint8_t *over_row = over ? malloc((size_t)clip_width * 4) : NULL;
+  bool status = row != NULL && rows != NULL && (!over || over_row != NULL);
+
+  for (uint32_t y = clip_y; status && y < clip_y + clip_height; y++) {
+    uint32_t start = y_taps.starts[y];
+    uint32_t count = y_taps.counts[y];
+    for (uint32_t t = 0; t < count; t++) {
+      /* Padding taps have no weight, but still need to point somewhere. */
+      uint32_t src_y = start + t < src_height ? start + t : src_height - 1;
+      rows[t] = (const uint8_t *)src + (size_t)src_y * src_stride +
+                (size_t)row_from * 4;
+    }
+
+    scale_rows(row + (size_t)row_from * 4, rows,
+               &y_taps.weights[(size_t)y * y_taps.max_taps], count,
+               (row_to - row_from) * 4);
+    uint8_t *dst_row = (uint8_t *)dst + (size_t)(y - clip_y) * dst_stride;
+    if (over) {
+      scale_columns(over_row, row, &clipped_x_taps, clip_width);
+      blend_over(dst_row, over_row, clip_width);
+    } else {
+      scale_columns(dst_row, row, &clipped_x_taps, clip_width);
+    }
+  }
+
+  free(over_row);
+  free(rows);
+  free(row);
+  scale_taps_finish(&y_taps);
+  scale_taps_finish(&x_taps);
+  return status;
+}
+
+bool scale_area_average(const void *src, uint32_t src_width,
+                        uint32_t src_height, uint32_t src_stride, void *dst,
+                        uint32_t dst_width, uint32_t dst_height,
+                        uint32_t dst_stride) {
+  return scale_area_average_clipped(src, src_width, src_height, src_stride,
+                                    dst_width, dst_height, 0, 0, dst_width,
+                                    dst_height, dst, dst_stride, false);
+}
+
+bool scale_area_average_over(const void *src, uint32_t src_width,
+                             uint32_t src_height, uint32_t src_stride,
+                             uint32_t dst_width, uint32_t dst_height,
+                             uint32_t clip_x, uint32_t clip_y,
+                             uint32_t clip_width, uint32_t clip_height,
+                             void *dst, uint32_t dst_stride) {
+  return scale_area_average_clipped(src, src_width, src_height, src_stride,
+                                    dst_width, dst_height, clip_x, clip_y,
+                                    clip_width, clip_height, dst, dst_stride,
+                                    true);
+}
+
+// vim:foldmethod=marker
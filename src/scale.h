@@ -0,0 +1,30 @@
+#ifndef _SCALE_H_
+#define _SCALE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Downscales a premultiplied ARGB32 image by averaging, for every destination
+ * pixel, the area of the source it covers. Works for any reduction ratio,
+ * integer or not, and is much faster and better looking than letting cairo
+ * scale with its default filter.
+ *
+ * Returns false if asked to upscale along either axis, which this can't do, or
+ * if we're out of memory. */
+bool scale_area_average(const void *src, uint32_t src_width,
+                        uint32_t src_height, uint32_t src_stride, void *dst,
+                        uint32_t dst_width, uint32_t dst_height,
+                        uint32_t dst_stride);
+
+/* Like scale_area_average(), but only produces the part of the
+ * dst_width x dst_height result within the clip rectangle, and composites it
+ * OVER what's already in dst rather than replacing it. `dst` points at where
+ * the clip rectangle's top-left pixel goes. */
+bool scale_area_average_over(const void *src, uint32_t src_width,
+                             uint32_t src_height, uint32_t src_stride,
+                             uint32_t dst_width, uint32_t dst_height,
+                             uint32_t clip_x, uint32_t clip_y,
+                             uint32_t clip_width, uint32_t clip_height,
+                             void *dst, uint32_t dst_stride);
+
+#endif /* _SCALE_H_ */
@@ -0,0 +1,178 @@
+#include "scene.h"
+#include "log.h"
+#include "pixel.h"
+#include <stdlib.h>
+#include <string.h>
+
+void scene_init(struct scene *scene) {
+  memset(scene, 0, sizeof(struct scene));
+  scene->damage = cairo_region_create();
+  scene->opaque = cairo_region_create();
+}
+
+void scene_begin_frame(struct scene *scene) {
+  cairo_region_destroy(scene->damage);
+  scene->damage = cairo_region_create();
+  scene->opaque_changed = false;
+}
+
+void scene_set_opaque(struct scene *scene, cairo_region_t *opaque) {
+  cairo_region_destroy(scene->opaque);
+  scene->opaque = opaque;
+  scene->opaque_changed = true;
+}
+
+void scene_damage(struct scene *scene, const struct rect *rect) {
+  cairo_rectangle_int_t damage = {
+      .x = rect->x,
+      .y = rect->y,
+      .width = rect->width,
+      .height = rect->height,
+  };
+  cairo_region_union_rectangle(scene->damage, &damage);
+  cairo_rectangle_int_t extents = {
+      .x = 0,
+      .y = 0,
+      .width = scene->width,
+      .height = scene->height,
+  };
+  cairo_region_intersect_rectangle(scene->damage, &extents);
+}
+
+static void destroy_layers(struct scene *scene) {
+  if (scene->base_cairo) {
+    cairo_destroy(scene->base_cairo);
+  }
+  if (scene->base_surface) {
+    cairo_surface_destroy(scene->base_surface);
+  }
+  if (scene->composed_cairo) {
+    cairo_destroy(scene->composed_cairo);
+  }
+  if (scene->composed_surface) {
+    cairo_surface_destroy(scene->composed_surface);
+  }
+  if (scene->dimmed_cairo) {
+    cairo_destroy(scene->dimmed_cairo);
+  }
+  if (scene->dimmed_surface) {
+    cairo_surface_destroy(scene->dimmed_surface);
+  }
+  scene->base_cairo = NULL;
+  scene->base_surface = NULL;
+  scene->composed_cairo = NULL;
+  scene->composed_surface = NULL;
+  scene->dimmed_cairo = NULL;
+  scene->dimmed_surface = NULL;
+  scene->width = 0;
+  scene->height = 0;
+}
+
+bool scene_resize(struct scene *scene, uint32_t width, uint32_t height) {
+  if (scene->base_surface != NULL && scene->width == width &&
+      scene->height == height) {
+    return false;
+  }
+
+  destroy_layers(scene);
+  scene->base_surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  scene->composed_surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  if (cairo_surface_status(scene->base_surface) != CAIRO_STATUS_SUCCESS ||
+      cairo_surface_status(scene->composed_surface) != CAIRO_STATUS_SUCCESS) {
+    log_error("Could not allocate the scene layers.\n");
+  }
+  scene->base_cairo = cairo_create(scene->base_surface);
+  scene->composed_cairo = cairo_create(scene->composed_surface);
+  scene->width = width;
+  scene->height = height;
+
+  scene_reset_nodes(scene, 0);
+  return true;
+}
+
+void scene_reset_nodes(struct scene *scene, uint32_t num_nodes) {
+  free(scene->nodes);
+  scene->nodes = calloc(num_nodes, sizeof(struct scene_node));
+  scene->num_nodes = num_nodes;
+}
+
+cairo_t *scene_dimmed_cairo(struct scene *scene) {
+  if (scene->dimmed_surface == NULL) {
+    scene->dimmed_surface = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, scene->width, scene->height);
+    if (cairo_surface_status(scene->dimmed_surface) != CAIRO_STATUS_SUCCESS) {
+      log_error("Could not allocate the dimmed scene layer.\n");
+    }
+    scene->dimmed_cairo = cairo_create(scene->dimmed_surface);
+  }
+  return scene->dimmed_cairo;
+}
+
+void scene_dim_node(struct scene *scene, struct scene_node *node,
+                    const struct rect *inner, uint8_t alpha) {
+  cairo_t *cr = scene_dimmed_cairo(scene);
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, scene->base_surface, 0, 0);
+  cairo_rectangle(cr, node->bounds.x, node->bounds.y, node->bounds.width,
+                  node->bounds.height);
+  cairo_fill(cr);
+  cairo_restore(cr);
+
+  if (inner->width <= 0 || inner->height <= 0) {
+    return;
+  }
+  cairo_surface_flush(scene->dimmed_surface);
+  uint32_t stride = cairo_image_surface_get_stride(scene->dimmed_surface);
+  uint8_t *data = cairo_image_surface_get_data(scene->dimmed_surface);
+  pixel_darken(data + inner->y * stride + inner->x * 4, inner->width,
+               inner->height, stride, alpha);
+  cairo_surface_mark_dirty_rectangle(scene->dimmed_surface, inner->x, inner->y,
+                                     inner->width, inner->height);
+}
+
+void scene_restore_node(struct scene *scene, struct scene_node *node) {
+  cairo_t *cr = scene->composed_cairo;
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(
+      cr, node->dim ? scene->dimmed_surface : scene->base_surface, 0, 0);
+  cairo_rectangle(cr, node->bounds.x, node->bounds.y, node->bounds.width,
+                  node->bounds.height);
+  cairo_fill(cr);
+  cairo_restore(cr);
+  scene_damage(scene, &node->bounds);
+}
+
+void scene_present(struct scene *scene, cairo_t *cr,
+                   const cairo_region_t *region) {
+  int num_rects = cairo_region_num_rectangles(region);
+  if (num_rects == 0) {
+    return;
+  }
+
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, scene->composed_surface, 0, 0);
+  for (int i = 0; i < num_rects; i++) {
+    cairo_rectangle_int_t rect;
+    cairo_region_get_rectangle(region, i, &rect);
+    cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+  }
+  cairo_fill(cr);
+  cairo_restore(cr);
+}
+
+void scene_destroy(struct scene *scene) {
+  destroy_layers(scene);
+  free(scene->nodes);
+  if (scene->damage) {
+    cairo_region_destroy(scene->damage);
+  }
+  if (scene->opaque) {
+    cairo_region_destroy(scene->opaque);
+  }
+  memset(scene, 0, sizeof(struct scene));
+}
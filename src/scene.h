@@ -0,0 +1,111 @@
+#ifndef _SCENE_H_
+#define _SCENE_H_
+
+#include "layout.h"
+#include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What's on screen, kept across frames so that a frame only redraws what
+ * changed since the last one. A frame is drawn in two layers:
+ * - The base layer holds what only changes with the layout or when a capture
+ *   comes in: the background, and each preview's box and thumbnail.
+ * - The composed layer is the base layer plus what changes with every key
+ *   press: titles, shortcuts and dimming. It's what gets copied into the
+ *   buffer we hand to the compositor.
+ * Dimmed previews are composed from a third layer instead, the dimmed layer,
+ * which holds the base layer's previews already dimmed. It's made the first
+ * time anything is dimmed, and each preview in it only when it's dimmed. That
+ * way, dimming or undimming a preview is only a matter of copying it over
+ * from one layer or the other.
+ * Each preview is a node, which remembers what it was drawn with. Whatever
+ * a frame redraws is collected as damage, so that's all the compositor has to
+ * look at again. */
+
+struct wm_client;
+
+struct scene_node {
+  struct wm_client *wm_client;
+  /* The preview's box, and everything drawing it may touch around it. */
+  struct rect      box;
+  struct rect      bounds;
+
+  /* The capture the base layer was drawn from, and whether that was the
+   * final version of it, rather than a rough one while it's being scaled. */
+  cairo_surface_t  *orig_surface;
+  bool             base_complete;
+
+  /* Whether the node is in the dimmed layer, as it is in the base layer. */
+  bool             dimmed_ready;
+
+  /* The state the composed layer was drawn with. */
+  bool             composed;
+  uint32_t         highlight_len;
+  bool             dim;
+};
+
+struct scene {
+  uint32_t          width;
+  uint32_t          height;
+
+  cairo_surface_t   *base_surface;
+  cairo_t           *base_cairo;
+  cairo_surface_t   *composed_surface;
+  cairo_t           *composed_cairo;
+  cairo_surface_t   *dimmed_surface;
+  cairo_t           *dimmed_cairo;
+
+  /* One per preview shown, in the order they're laid out. */
+  struct scene_node *nodes;
+  uint32_t          num_nodes;
+
+  /* What changed in the composed layer this frame, in buffer pixels. */
+  cairo_region_t    *damage;
+
+  /* What of the composed layer nothing shows through, in buffer pixels, and
+   * whether that changed this frame. */
+  cairo_region_t    *opaque;
+  bool              opaque_changed;
+};
+
+void scene_init(struct scene *scene);
+
+/* Forgets about the damage of the previous frame. */
+void scene_begin_frame(struct scene *scene);
+
+/* Marks `rect` of the composed layer as changed this frame. */
+void scene_damage(struct scene *scene, const struct rect *rect);
+
+/* Replaces the opaque region, taking ownership of `opaque`. */
+void scene_set_opaque(struct scene *scene, cairo_region_t *opaque);
+
+/* Makes sure the layers are width x height. Returns true if they had to be
+ * recreated, in which case they're empty and every node has to be drawn
+ * again. */
+bool scene_resize(struct scene *scene, uint32_t width, uint32_t height);
+
+/* Starts over with `num_nodes` nodes, none of them drawn yet. */
+void scene_reset_nodes(struct scene *scene, uint32_t num_nodes);
+
+/* Makes sure there's a dimmed layer, empty if it's new. Returns its cairo. */
+cairo_t *scene_dimmed_cairo(struct scene *scene);
+
+/* Copies the node's bounds from the base layer to the dimmed layer, with
+ * `inner` darkened by black at `alpha`. Whatever of the bounds is outside
+ * `inner` is left for the caller to dim. */
+void scene_dim_node(struct scene *scene, struct scene_node *node,
+                    const struct rect *inner, uint8_t alpha);
+
+/* Puts the node's bounds in the composed layer back to what's in the base
+ * layer, or in the dimmed layer if node->dim is set, ready for the node to be
+ * composed again, and damages them. */
+void scene_restore_node(struct scene *scene, struct scene_node *node);
+
+/* Copies `region` of the composed layer to the target of `cr`, which must be
+ * the size of the scene. */
+void scene_present(struct scene *scene, cairo_t *cr,
+                   const cairo_region_t *region);
+
+void scene_destroy(struct scene *scene);
+
+#endif /* _SCENE_H_ */
@@ -1,7 +1,8 @@
 #include "surface.h"
 #include "log.h"
+#include "scale.h"
 #include "shm.h"
-#include "vec.h"
+#include "util.h"
 #include <cairo/cairo.h>
 #include <fcntl.h>
 #include <pango/pango-font.h>
@@ -11,56 +12,217 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+static void surface_buffer_destroy(struct surface_buffer *buffer);
+static bool in_slots(const struct surface_buffer_pool *pool,
+                     const struct surface_buffer *buffer);
+static void reclaim_shm(struct surface_buffer_pool *pool);
+
 static void handle_buffer_release(void *data, struct wl_buffer *wl_buffer) {
-  ((struct surface_buffer *)data)->state = SURFACE_BUFFER_READY;
+  struct surface_buffer *buffer = data;
+  buffer->state = SURFACE_BUFFER_READY;
+
+  struct surface_buffer_pool *pool = buffer->pool;
+  /* Left behind when the slots grew, and the wrong size since. */
+  if (!in_slots(pool, buffer)) {
+    surface_buffer_destroy(buffer);
+    reclaim_shm(pool);
+  }
+  if (pool->waiting) {
+    pool->waiting = false;
+    pool->released_cb(pool->released_data);
+  }
 }
 
 static const struct wl_buffer_listener wl_buffer_listener = {
     .release = handle_buffer_release,
 };
 
-static struct surface_buffer *surface_buffer_init(struct config *config,
-                                                  struct wl_shm *wl_shm,
-                                                  struct surface_buffer *buffer,
-                                                  int32_t width,
-                                                  int32_t height) {
-  const uint32_t stride =
-      cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
-  const uint32_t data_size = height * stride;
-  void *data;
+static void surface_buffer_destroy(struct surface_buffer *buffer) {
+  if (buffer->state == SURFACE_BUFFER_UNITIALIZED) {
+    return;
+  }
 
-  int fd = shm_allocate_file(data_size);
-  if (fd < 0) {
-    log_error("Could not allocate shared buffer for surface buffer.\n");
-    return NULL;
+  if (buffer->cairo) {
+    cairo_destroy(buffer->cairo);
   }
 
-  data = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (data == MAP_FAILED) {
-    log_error("Could not mmap shared buffer for surface buffer.\n");
+  if (buffer->cairo_surface) {
+    cairo_surface_destroy(buffer->cairo_surface);
+  }
 
-    close(fd);
-    return NULL;
+  if (buffer->wl_buffer) {
+    wl_buffer_destroy(buffer->wl_buffer);
   }
 
-  struct wl_shm_pool *wl_shm_pool = wl_shm_create_pool(wl_shm, fd, data_size);
-  buffer->wl_buffer = wl_shm_pool_create_buffer(wl_shm_pool, 0, width, height,
-                                                stride, WL_SHM_FORMAT_ARGB8888);
-  wl_buffer_add_listener(buffer->wl_buffer, &wl_buffer_listener, buffer);
-  wl_shm_pool_destroy(wl_shm_pool);
+  if (buffer->stale) {
+    cairo_region_destroy(buffer->stale);
+  }
 
-  buffer->data = data;
-  buffer->data_size = data_size;
-  buffer->width = width;
-  buffer->height = height;
-  buffer->state = SURFACE_BUFFER_READY;
+  memset(buffer, 0, sizeof(struct surface_buffer));
+}
 
+/* (Re-)creates the cairo surface over the buffer's slot of the mapping. */
+static void surface_buffer_map(struct surface_buffer *buffer) {
+  if (buffer->cairo) {
+    cairo_destroy(buffer->cairo);
+  }
+  if (buffer->cairo_surface) {
+    cairo_surface_destroy(buffer->cairo_surface);
+  }
+  buffer->data = (uint8_t *)buffer->pool->shm_data + buffer->offset;
   buffer->cairo_surface = cairo_image_surface_create_for_data(
-      buffer->data, CAIRO_FORMAT_ARGB32, width, height, stride);
+      buffer->data, buffer->pool->cairo_format, buffer->width, buffer->height,
+      buffer->stride);
   buffer->cairo = cairo_create(buffer->cairo_surface);
+}
+
+/* Drops the shared memory altogether, along with every buffer in it. */
+static void release_shm(struct surface_buffer_pool *pool) {
+  for (size_t i = 0; i < SURFACE_BUFFER_POOL_MAX_BUFFERS; i++) {
+    surface_buffer_destroy(&pool->buffers[i]);
+  }
+  if (pool->wl_shm_pool) {
+    wl_shm_pool_destroy(pool->wl_shm_pool);
+  }
+  if (pool->shm_data) {
+    munmap(pool->shm_data, pool->shm_size);
+  }
+  if (pool->shm_fd >= 0) {
+    close(pool->shm_fd);
+  }
+  pool->wl_shm_pool = NULL;
+  pool->shm_data = NULL;
+  pool->shm_fd = -1;
+  pool->shm_size = 0;
+  pool->slot_base = 0;
+  pool->slot_size = 0;
+  pool->shm_reclaimable = false;
+}
+
+static bool in_slots(const struct surface_buffer_pool *pool,
+                     const struct surface_buffer *buffer) {
+  return buffer->offset >= pool->slot_base &&
+         buffer->offset <
+             pool->slot_base + pool->max_buffers * pool->slot_size;
+}
+
+/* Once the last buffer left outside the slots is gone, the memory around the
+ * slots is given back. The mapping and the file keep their size, since the
+ * compositor's wl_shm_pool can't shrink, but the pages are freed. */
+static void reclaim_shm(struct surface_buffer_pool *pool) {
+  if (!pool->shm_reclaimable) {
+    return;
+  }
+  for (size_t i = 0; i < SURFACE_BUFFER_POOL_MAX_BUFFERS; i++) {
+    if (pool->buffers[i].state != SURFACE_BUFFER_UNITIALIZED &&
+        !in_slots(pool, &pool->buffers[i])) {
+      return;
+    }
+  }
+  pool->shm_reclaimable = false;
+
+#ifdef __linux__
+  size_t slots_end = pool->slot_base + pool->max_buffers * pool->slot_size;
+  size_t ranges[2][2] = {
+      {0, pool->slot_base},
+      {slots_end, pool->shm_size},
+  };
+  for (size_t i = 0; i < 2; i++) {
+    if (ranges[i][1] > ranges[i][0] &&
+        fallocate(pool->shm_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  ranges[i][0], ranges[i][1] - ranges[i][0]) < 0) {
+      log_debug("Could not free unused surface buffer memory.\n");
+    }
+  }
+  log_debug("Freed surface buffer memory outside of %zu bytes of slots.\n",
+            slots_end - pool->slot_base);
+#endif
+}
+
+/* Makes sure every buffer of the pool fits in a slot of `slot_size` bytes.
+ * Slots only ever grow, so most resizes and scale changes don't touch the
+ * shared memory at all. Memory the slots move away from is freed once no
+ * buffer uses it, see reclaim_shm(). */
+static bool reserve_slots(struct surface_buffer_pool *pool,
+                          struct wl_shm *wl_shm, size_t slot_size) {
+  if (slot_size <= pool->slot_size) {
+    return true;
+  }
+
+  /* Buffers the compositor still holds keep their memory until it's done with
+   * them, so the new slots go after theirs. Any other buffer is the wrong
+   * size now anyway. */
+  bool busy = false;
+  for (size_t i = 0; i < SURFACE_BUFFER_POOL_MAX_BUFFERS; i++) {
+    if (pool->buffers[i].state == SURFACE_BUFFER_BUSY) {
+      busy = true;
+    } else {
+      surface_buffer_destroy(&pool->buffers[i]);
+    }
+  }
+  size_t slot_base = busy ? pool->shm_size : 0;
+  size_t shm_size =
+      MAX(pool->shm_size, slot_base + pool->max_buffers * slot_size);
+
+  if (pool->shm_fd < 0) {
+    pool->shm_fd = shm_allocate_file(shm_size);
+    if (pool->shm_fd < 0) {
+      log_error("Could not allocate shared memory for surface buffers.\n");
+      return false;
+    }
+    pool->wl_shm_pool = wl_shm_create_pool(wl_shm, pool->shm_fd, shm_size);
+  } else if (shm_size > pool->shm_size) {
+    if (shm_reallocate_file(pool->shm_fd, shm_size) < 0) {
+      log_error("Could not grow shared memory for surface buffers.\n");
+      /* shm_reallocate_file() closed it already. */
+      pool->shm_fd = -1;
+      release_shm(pool);
+      return false;
+    }
+    wl_shm_pool_resize(pool->wl_shm_pool, shm_size);
+  }
+
+  if (shm_size != pool->shm_size) {
+    if (pool->shm_data) {
+      munmap(pool->shm_data, pool->shm_size);
+    }
+    pool->shm_data = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          pool->shm_fd, 0);
+    pool->shm_size = shm_size;
+    if (pool->shm_data == MAP_FAILED) {
+      log_error("Could not mmap shared memory for surface buffers.\n");
+      pool->shm_data = NULL;
+      release_shm(pool);
+      return false;
+    }
+    /* The busy buffers moved along with the mapping. */
+    for (size_t i = 0; i < SURFACE_BUFFER_POOL_MAX_BUFFERS; i++) {
+      if (pool->buffers[i].state != SURFACE_BUFFER_UNITIALIZED) {
+        surface_buffer_map(&pool->buffers[i]);
+      }
+    }
+  }
+
+  log_debug("Surface buffer slots are now %zu bytes, %zu bytes in all.\n",
+            slot_size, shm_size);
+  pool->slot_base = slot_base;
+  pool->slot_size = slot_size;
+  /* Whatever the slots moved away from is only still needed for the busy
+   * buffers, if any. */
+  pool->shm_reclaimable = pool->shm_reclaimable || slot_base > 0 ||
+                          slot_base + pool->max_buffers * slot_size < shm_size;
+  reclaim_shm(pool);
+  return true;
+}
 
+/* Text is laid out the same way whatever buffer it's drawn into, so there's
+ * one Pango context for the whole pool, made the first time it's needed. The
+ * layouts themselves are kept by whoever draws them, see text_layout.h. */
+static void create_pango_context(struct config *config,
+                                 struct surface_buffer_pool *pool,
+                                 cairo_t *cairo) {
   log_debug("Creating Pango context.\n");
-  PangoContext *context = pango_cairo_create_context(buffer->cairo);
+  PangoContext *context = pango_cairo_create_context(cairo);
 
   log_debug("Creating Pango font description.\n");
   PangoFontDescription *font_description =
@@ -69,8 +231,6 @@ static struct surface_buffer *surface_buffer_init(struct config *config,
                                   config->font_size * PANGO_SCALE);
   pango_context_set_font_description(context, font_description);
 
-  buffer->pango_layout = pango_layout_new(context);
-
   log_debug("Loading Pango font.\n");
   PangoFontMap *map = pango_cairo_font_map_get_default();
   PangoFont *font = pango_font_map_load_font(map, context, font_description);
@@ -82,72 +242,140 @@ static struct surface_buffer *surface_buffer_init(struct config *config,
 
   pango_font_description_free(font_description);
 
-  buffer->pango_context = context;
-
-  return buffer;
+  pool->pango_context = context;
 }
 
-static void surface_buffer_destroy(struct surface_buffer *buffer) {
-  if (buffer->state == SURFACE_BUFFER_UNITIALIZED) {
-    return;
-  }
+static struct surface_buffer *surface_buffer_init(
+    struct config *config, struct wl_shm *wl_shm,
+    struct surface_buffer_pool *pool, struct surface_buffer *buffer,
+    int32_t width, int32_t height) {
+  const uint32_t stride =
+      cairo_format_stride_for_width(pool->cairo_format, width);
+  const uint32_t data_size = height * stride;
 
-  if (buffer->cairo) {
-    cairo_destroy(buffer->cairo);
+  if (!reserve_slots(pool, wl_shm, data_size)) {
+    return NULL;
   }
 
-  if (buffer->cairo_surface) {
-    cairo_surface_destroy(buffer->cairo_surface);
-  }
+  buffer->pool = pool;
+  buffer->offset = pool->slot_base + (buffer - pool->buffers) * pool->slot_size;
+  buffer->wl_buffer =
+      wl_shm_pool_create_buffer(pool->wl_shm_pool, buffer->offset, width,
+                                height, stride, pool->format);
+  wl_buffer_add_listener(buffer->wl_buffer, &wl_buffer_listener, buffer);
 
-  if (buffer->wl_buffer) {
-    wl_buffer_destroy(buffer->wl_buffer);
+  buffer->stride = stride;
+  buffer->width = width;
+  buffer->height = height;
+  buffer->state = SURFACE_BUFFER_READY;
+  buffer->stale = cairo_region_create_rectangle(&(cairo_rectangle_int_t){
+      .width = width,
+      .height = height,
+  });
+  surface_buffer_map(buffer);
+
+  if (pool->pango_context == NULL) {
+    create_pango_context(config, pool, buffer->cairo);
   }
 
-  if (buffer->data) {
-    munmap(buffer->data, buffer->data_size);
-  }
+  return buffer;
+}
+
+void surface_buffer_pool_init(struct surface_buffer_pool *pool,
+                              uint32_t max_buffers, bool opaque,
+                              surface_buffer_released_cb released_cb,
+                              void *released_data) {
+  memset(pool, 0, sizeof(struct surface_buffer_pool));
+  pool->shm_fd = -1;
+  /* Both formats are the same in memory, XRGB8888 just tells the compositor
+   * there's nothing to blend. */
+  pool->format = opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+  pool->cairo_format = opaque ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32;
+  pool->max_buffers = CLAMP(max_buffers, SURFACE_BUFFER_POOL_MIN_BUFFERS,
+                            SURFACE_BUFFER_POOL_MAX_BUFFERS);
+  pool->released_cb = released_cb;
+  pool->released_data = released_data;
+}
+
+void surface_buffer_pool_destroy(struct surface_buffer_pool *pool) {
+  release_shm(pool);
 
-  if (buffer->pango_layout) {
+  if (pool->pango_context) {
     /* This fixes a lot of valgrind errors. Probably because pango uses this
      * internally and doesn't free it itself. */
     g_object_unref(pango_cairo_font_map_get_default());
-    g_object_unref(buffer->pango_layout);
-  }
-
-  if (buffer->pango_context) {
     /* Unfortunately, no matter what I do, valgrind reports pango_context as
      * leaking. https://bugzilla.gnome.org/show_bug.cgi?id=573389 */
-    g_object_unref(buffer->pango_context);
+    g_object_unref(pool->pango_context);
   }
-
-  memset(buffer, 0, sizeof(struct surface_buffer));
 }
 
-void surface_buffer_pool_init(struct surface_buffer_pool *pool) {
-  memset(pool, 0, sizeof(struct surface_buffer_pool));
-}
-
-void surface_buffer_pool_destroy(struct surface_buffer_pool *pool) {
-  surface_buffer_destroy(&pool->buffers[0]);
-  surface_buffer_destroy(&pool->buffers[1]);
+void surface_buffer_pool_damage(struct surface_buffer_pool *pool,
+                                const cairo_region_t *damage) {
+  for (size_t i = 0; i < SURFACE_BUFFER_POOL_MAX_BUFFERS; i++) {
+    if (pool->buffers[i].stale != NULL) {
+      cairo_region_union(pool->buffers[i].stale, damage);
+    }
+  }
 }
 
 struct surface_buffer *get_next_buffer(struct config *config,
                                        struct wl_shm *wl_shm,
                                        struct surface_buffer_pool *pool,
                                        uint32_t width, uint32_t height) {
+  uint32_t now_ms = gettime_ms();
   struct surface_buffer *buffer = NULL;
-  for (size_t i = 0; i < 2; i++) {
-    if (pool->buffers[i].state != SURFACE_BUFFER_BUSY) {
-      buffer = &pool->buffers[i];
-      break;
+  struct surface_buffer *unused = NULL;
+  uint32_t num_buffers = 0;
+  for (size_t i = 0; i < pool->max_buffers; i++) {
+    struct surface_buffer *candidate = &pool->buffers[i];
+    if (candidate->state == SURFACE_BUFFER_UNITIALIZED) {
+      if (unused == NULL) {
+        unused = candidate;
+      }
+      continue;
+    }
+    num_buffers++;
+    if (candidate->state == SURFACE_BUFFER_BUSY) {
+      continue;
+    }
+
+    /* A buffer of the right size that was used most recently has the least
+     * to catch up on. */
+    bool right_size = candidate->width == width && candidate->height == height;
+    bool buffer_right_size = buffer != NULL && buffer->width == width &&
+                             buffer->height == height;
+    if (buffer == NULL || (right_size && !buffer_right_size) ||
+        (right_size == buffer_right_size &&
+         (int32_t)(candidate->last_used_ms - buffer->last_used_ms) > 0)) {
+      buffer = candidate;
     }
   }
 
   if (buffer == NULL) {
-    log_warning("All surface buffers are busy.\n");
-    return NULL;
+    if (unused == NULL) {
+      log_warning("All %u surface buffers are busy.\n", num_buffers);
+      pool->waiting = true;
+      return NULL;
+    }
+    log_debug("Growing the surface buffer pool to %u buffers.\n",
+              num_buffers + 1);
+    buffer = unused;
+    num_buffers++;
+  }
+
+  /* Free buffers we haven't needed for a while, e.g. since a burst of
+   * frames the compositor was slow to release. */
+  for (size_t i = 0; i < pool->max_buffers; i++) {
+    struct surface_buffer *idle = &pool->buffers[i];
+    if (num_buffers > SURFACE_BUFFER_POOL_MIN_BUFFERS && idle != buffer &&
+        idle->state == SURFACE_BUFFER_READY &&
+        now_ms - idle->last_used_ms > SURFACE_BUFFER_IDLE_MS) {
+      log_debug("Shrinking the surface buffer pool to %u buffers.\n",
+                num_buffers - 1);
+      surface_buffer_destroy(idle);
+      num_buffers--;
+    }
   }
 
   if (buffer->width != width || buffer->height != height) {
@@ -155,75 +383,570 @@ struct surface_buffer *get_next_buffer(struct config *config,
   }
 
   if (buffer->state == SURFACE_BUFFER_UNITIALIZED) {
-    if (surface_buffer_init(config, wl_shm, buffer, width, height) == NULL) {
+    if (surface_buffer_init(config, wl_shm, pool, buffer, width, height) ==
+        NULL) {
       log_error("Could not initialize next buffer.\n");
       return NULL;
     }
   }
+  buffer->last_used_ms = now_ms;
 
   return buffer;
 }
 
-struct surface_cache *surface_cache_init(cairo_surface_t *source_surface) {
+/* A scaling job in flight on the worker pool. */
+struct surface_cache_job {
+  struct worker_job           worker_job;
+  /* In the cache's jobs, until either the job or the cache is done. */
+  struct wl_list              link;
+  struct surface_cache        *cache;
+
+  /* Referenced, so it stays alive even if the cache moves on. */
+  cairo_surface_t             *source_surface;
+  cairo_surface_t             *scaled_surface;
+  int                         scaled_width;
+  int                         scaled_height;
+  bool                        scaled;
+
+  /* Counted in the budget's pending_bytes until the job lands. The budget
+   * outlives every cache, so this stays valid for orphaned jobs too. */
+  struct surface_cache_budget *budget;
+  size_t                      size;
+  /* Only asked for in case it's needed later, see surface_cache_prescale(). */
+  bool                        speculative;
+};
+
+/* Builds the levels of a cache's pyramid on the worker pool. */
+struct surface_cache_pyramid_job {
+  struct worker_job    worker_job;
+  struct surface_cache *cache;
+
+  cairo_surface_t      *source_surface;
+  cairo_surface_t      *levels[SURFACE_CACHE_MAX_LEVELS];
+  uint32_t             num_levels;
+  bool                 built;
+};
+
+static bool scale_surface_data(cairo_surface_t *source_surface,
+                               cairo_surface_t *scaled_surface);
+
+/* Creates the (empty) levels of the pyramid for a source of the given size,
+ * and returns how many there are. */
+static uint32_t create_levels(cairo_surface_t **levels, int width,
+                              int height) {
+  uint32_t num_levels = 0;
+  while (num_levels < SURFACE_CACHE_MAX_LEVELS &&
+         width / 2 >= SURFACE_CACHE_MIN_LEVEL_SIZE &&
+         height / 2 >= SURFACE_CACHE_MIN_LEVEL_SIZE) {
+    width /= 2;
+    height /= 2;
+    levels[num_levels] =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_surface_flush(levels[num_levels]);
+    num_levels++;
+  }
+  return num_levels;
+}
+
+/* Fills in every level from the one above it. Only touches pixel data, so
+ * this is fine to run on a worker. */
+static bool build_levels(cairo_surface_t *source_surface,
+                         cairo_surface_t **levels, uint32_t num_levels) {
+  cairo_surface_t *above = source_surface;
+  for (uint32_t i = 0; i < num_levels; i++) {
+    if (!scale_surface_data(above, levels[i])) {
+      return false;
+    }
+    above = levels[i];
+  }
+  return true;
+}
+
+static void destroy_levels(cairo_surface_t **levels, uint32_t num_levels) {
+  for (uint32_t i = 0; i < num_levels; i++) {
+    cairo_surface_destroy(levels[i]);
+  }
+}
+
+/* Hands the built levels over to the cache. */
+static void set_levels(struct surface_cache *cache, cairo_surface_t **levels,
+                       uint32_t num_levels, bool built) {
+  cache->levels_built = true;
+  if (!built) {
+    destroy_levels(levels, num_levels);
+    return;
+  }
+  for (uint32_t i = 0; i < num_levels; i++) {
+    cairo_surface_mark_dirty(levels[i]);
+    cache->levels[i] = levels[i];
+    cache->levels_size += (size_t)cairo_image_surface_get_stride(levels[i]) *
+                          cairo_image_surface_get_height(levels[i]);
+  }
+  cache->num_levels = num_levels;
+  cache->budget->level_bytes += cache->levels_size;
+}
+
+static void run_pyramid_job(struct worker_job *worker_job) {
+  struct surface_cache_pyramid_job *job =
+      wl_container_of(worker_job, job, worker_job);
+  job->built =
+      build_levels(job->source_surface, job->levels, job->num_levels);
+}
+
+static void handle_pyramid_job_done(struct worker_job *worker_job) {
+  struct surface_cache_pyramid_job *job =
+      wl_container_of(worker_job, job, worker_job);
+  if (job->cache != NULL) {
+    job->cache->pyramid_job = NULL;
+    set_levels(job->cache, job->levels, job->num_levels, job->built);
+  } else {
+    destroy_levels(job->levels, job->num_levels);
+  }
+  cairo_surface_destroy(job->source_surface);
+  free(job);
+}
+
+/* Without a worker pool, the pyramid is built on the first miss instead. */
+static void build_levels_sync(struct surface_cache *cache) {
+  if (cache->levels_built || cache->pyramid_job != NULL) {
+    return;
+  }
+  cairo_surface_t *levels[SURFACE_CACHE_MAX_LEVELS];
+  uint32_t num_levels =
+      create_levels(levels, cache->source_width, cache->source_height);
+  cairo_surface_flush(cache->source_surface);
+  set_levels(cache, levels, num_levels,
+             build_levels(cache->source_surface, levels, num_levels));
+}
+
+/* The smallest surface we have that is still at least the given size. */
+static cairo_surface_t *pick_scale_source(struct surface_cache *cache,
+                                          int new_width, int new_height) {
+  for (uint32_t i = cache->num_levels; i-- > 0;) {
+    if (cairo_image_surface_get_width(cache->levels[i]) >= new_width &&
+        cairo_image_surface_get_height(cache->levels[i]) >= new_height) {
+      return cache->levels[i];
+    }
+  }
+  return cache->source_surface;
+}
+
+void surface_cache_budget_init(struct surface_cache_budget *budget,
+                               size_t max_bytes) {
+  wl_list_init(&budget->lru);
+  budget->bytes = 0;
+  budget->pending_bytes = 0;
+  budget->level_bytes = 0;
+  budget->max_bytes = max_bytes;
+}
+
+static uint64_t cache_entry_key(int width, int height) {
+  return (uint64_t)(uint32_t)width << 32 | (uint32_t)height;
+}
+
+static void destroy_cache_entry(struct surface_cache_entry *entry) {
+  struct surface_cache_budget *budget = entry->cache->budget;
+  wl_list_remove(&entry->lru_link);
+  budget->bytes -= entry->size;
+  cairo_surface_destroy(entry->scaled_surface);
+  free(entry);
+}
+
+/* Evicts the least recently used entries, of any cache, until we're within
+ * budget again. `keep` is never evicted, since it's about to be used. */
+static void enforce_budget(struct surface_cache_budget *budget,
+                           struct surface_cache_entry *keep) {
+  while (budget->bytes > budget->max_bytes) {
+    struct surface_cache_entry *entry =
+        wl_container_of(budget->lru.prev, entry, lru_link);
+    if (entry == keep) {
+      break;
+    }
+    log_debug("Evicting %dx%d scaled surface, %zu bytes cached, %zu more in "
+              "pyramids\n",
+              entry->scaled_width, entry->scaled_height, budget->bytes,
+              budget->level_bytes);
+    g_hash_table_remove(entry->cache->entries, &entry->key);
+    destroy_cache_entry(entry);
+  }
+}
+
+struct surface_cache *surface_cache_init(cairo_surface_t *source_surface,
+                                         struct surface_cache_budget *budget,
+                                         struct worker_pool *worker_pool,
+                                         surface_cache_scaled_cb scaled_cb,
+                                         void *scaled_cb_data) {
   struct surface_cache *cache = malloc(sizeof(struct surface_cache));
   cache->source_surface = source_surface;
   cache->source_width = cairo_image_surface_get_width(source_surface);
   cache->source_height = cairo_image_surface_get_height(source_surface);
 
-  cache->entries = vec_init(sizeof(struct surface_cache_entry));
+  cache->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+  cache->budget = budget;
+
+  cache->worker_pool = worker_pool;
+  wl_list_init(&cache->jobs);
+  cache->scaled_cb = scaled_cb;
+  cache->scaled_cb_data = scaled_cb_data;
+
+  cache->num_levels = 0;
+  cache->levels_size = 0;
+  cache->levels_built = false;
+  cache->pyramid_job = NULL;
+  cache->num_direct_keys = 0;
+  if (worker_pool != NULL) {
+    struct surface_cache_pyramid_job *job =
+        calloc(1, sizeof(struct surface_cache_pyramid_job));
+    job->cache = cache;
+    job->source_surface = cairo_surface_reference(source_surface);
+    job->num_levels = create_levels(job->levels, cache->source_width,
+                                    cache->source_height);
+    cairo_surface_flush(source_surface);
+    cache->pyramid_job = job;
+    worker_pool_submit(worker_pool, &job->worker_job, run_pyramid_job,
+                       handle_pyramid_job_done);
+  }
   return cache;
 }
 
 void surface_cache_destroy(struct surface_cache *cache) {
-  vec_destroy(cache->entries);
+  /* Jobs still running will find out they're orphaned when they're done. */
+  struct surface_cache_job *job, *tmp;
+  wl_list_for_each_safe(job, tmp, &cache->jobs, link) {
+    wl_list_remove(&job->link);
+    wl_list_init(&job->link);
+    job->cache = NULL;
+  }
+  if (cache->pyramid_job != NULL) {
+    cache->pyramid_job->cache = NULL;
+  }
+  destroy_levels(cache->levels, cache->num_levels);
+  cache->budget->level_bytes -= cache->levels_size;
+
+  GHashTableIter iter;
+  gpointer entry;
+  g_hash_table_iter_init(&iter, cache->entries);
+  while (g_hash_table_iter_next(&iter, NULL, &entry)) {
+    destroy_cache_entry(entry);
+  }
+  g_hash_table_destroy(cache->entries);
   memset(cache, 0, sizeof(struct surface_cache));
   free(cache);
 }
 
+void surface_cache_replace_source(struct surface_cache *cache,
+                                  cairo_surface_t *source_surface) {
+  cache->source_surface = source_surface;
+}
+
+/* Looks up an entry, marking it as the most recently used. */
 struct surface_cache_entry *find_cache_entry(struct surface_cache *cache,
                                              int new_width, int new_height) {
-  struct surface_cache_entry *surface_cache_entry;
-  for (uint32_t i = 0; i < cache->entries->count; i++) {
-    surface_cache_entry = vec_get(cache->entries, i);
-    if (surface_cache_entry->scaled_width == new_width &&
-        surface_cache_entry->scaled_height == new_height) {
-      return surface_cache_entry;
-    }
+  uint64_t key = cache_entry_key(new_width, new_height);
+  struct surface_cache_entry *surface_cache_entry =
+      g_hash_table_lookup(cache->entries, &key);
+  if (surface_cache_entry != NULL) {
+    wl_list_remove(&surface_cache_entry->lru_link);
+    wl_list_insert(&cache->budget->lru, &surface_cache_entry->lru_link);
+  }
+  return surface_cache_entry;
+}
+
+/* Previews are almost always downscaled, which we can do ourselves much
+ * faster than cairo. This only touches pixel data, so it's safe to call from
+ * worker threads, as long as both surfaces were flushed beforehand. */
+static bool scale_surface_data(cairo_surface_t *source_surface,
+                               cairo_surface_t *scaled_surface) {
+  return scale_area_average(
+      cairo_image_surface_get_data(source_surface),
+      cairo_image_surface_get_width(source_surface),
+      cairo_image_surface_get_height(source_surface),
+      cairo_image_surface_get_stride(source_surface),
+      cairo_image_surface_get_data(scaled_surface),
+      cairo_image_surface_get_width(scaled_surface),
+      cairo_image_surface_get_height(scaled_surface),
+      cairo_image_surface_get_stride(scaled_surface));
+}
+
+static void scale_surface_cairo(cairo_surface_t *source_surface,
+                                cairo_surface_t *scaled_surface) {
+  cairo_t *scaled_ctx = cairo_create(scaled_surface);
+
+  // Calculate scaling factors
+  double scale_x = (double)cairo_image_surface_get_width(scaled_surface) /
+                   cairo_image_surface_get_width(source_surface);
+  double scale_y = (double)cairo_image_surface_get_height(scaled_surface) /
+                   cairo_image_surface_get_height(source_surface);
+
+  // Apply scaling and draw the source surface onto the scaled surface
+  cairo_scale(scaled_ctx, scale_x, scale_y);
+  cairo_set_source_surface(scaled_ctx, source_surface, 0, 0);
+  cairo_paint(scaled_ctx);
+
+  cairo_destroy(scaled_ctx);
+}
+
+static size_t surface_size(cairo_surface_t *surface) {
+  return (size_t)cairo_image_surface_get_stride(surface) *
+         cairo_image_surface_get_height(surface);
+}
+
+/* Speculative surfaces never evict anything: they're dropped if they don't
+ * fit, and go in as the least recently used, so they're the first to make
+ * room for what's actually drawn. */
+static void append_cache_entry(struct surface_cache *cache,
+                               cairo_surface_t *scaled_surface, int new_width,
+                               int new_height, bool speculative) {
+  struct surface_cache_budget *budget = cache->budget;
+  size_t size = surface_size(scaled_surface);
+  if (speculative && budget->bytes + size > budget->max_bytes) {
+    cairo_surface_destroy(scaled_surface);
+    return;
+  }
+
+  struct surface_cache_entry *surface_cache_entry =
+      malloc(sizeof(struct surface_cache_entry));
+  surface_cache_entry->scaled_surface = scaled_surface;
+  surface_cache_entry->scaled_width = new_width;
+  surface_cache_entry->scaled_height = new_height;
+  surface_cache_entry->size = size;
+  surface_cache_entry->key = cache_entry_key(new_width, new_height);
+  surface_cache_entry->cache = cache;
+
+  g_hash_table_insert(cache->entries, &surface_cache_entry->key,
+                      surface_cache_entry);
+  budget->bytes += size;
+  if (speculative) {
+    wl_list_insert(budget->lru.prev, &surface_cache_entry->lru_link);
+  } else {
+    wl_list_insert(&budget->lru, &surface_cache_entry->lru_link);
+    enforce_budget(budget, surface_cache_entry);
   }
-  return NULL;
 }
 
 cairo_surface_t *surface_cache_get_scaled(struct surface_cache *cache,
                                           int new_width, int new_height) {
-  struct surface_cache_entry surface_cache_entry;
   struct surface_cache_entry *p_surface_cache_entry =
       find_cache_entry(cache, new_width, new_height);
+  if (p_surface_cache_entry != NULL) {
+    return p_surface_cache_entry->scaled_surface;
+  }
+
+  // Create a new scaled surface
+  build_levels_sync(cache);
+  cairo_surface_t *source_surface =
+      pick_scale_source(cache, new_width, new_height);
+  cairo_surface_t *scaled_surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
+  cairo_surface_flush(source_surface);
+  cairo_surface_flush(scaled_surface);
+  if (scale_surface_data(source_surface, scaled_surface)) {
+    cairo_surface_mark_dirty(scaled_surface);
+  } else {
+    scale_surface_cairo(source_surface, scaled_surface);
+  }
+
+  append_cache_entry(cache, scaled_surface, new_width, new_height, false);
+  return scaled_surface;
+}
+
+static void run_scale_job(struct worker_job *worker_job) {
+  struct surface_cache_job *job =
+      wl_container_of(worker_job, job, worker_job);
+  job->scaled = scale_surface_data(job->source_surface, job->scaled_surface);
+}
+
+static void handle_scale_job_done(struct worker_job *worker_job) {
+  struct surface_cache_job *job =
+      wl_container_of(worker_job, job, worker_job);
+  struct surface_cache *cache = job->cache;
+  job->budget->pending_bytes -= job->size;
+
+  if (cache == NULL ||
+      find_cache_entry(cache, job->scaled_width, job->scaled_height) != NULL) {
+    /* Nobody's waiting for this anymore. */
+    cairo_surface_destroy(job->scaled_surface);
+  } else {
+    if (job->scaled) {
+      cairo_surface_mark_dirty(job->scaled_surface);
+    } else {
+      /* The pool was torn down before getting to it, or we couldn't scale
+       * it ourselves. */
+      scale_surface_cairo(job->source_surface, job->scaled_surface);
+    }
+    append_cache_entry(cache, job->scaled_surface, job->scaled_width,
+                       job->scaled_height, job->speculative);
+  }
+
+  if (cache != NULL) {
+    wl_list_remove(&job->link);
+    if (cache->scaled_cb) {
+      cache->scaled_cb(cache->scaled_cb_data, job->scaled_width,
+                       job->scaled_height);
+    }
+  }
+  cairo_surface_destroy(job->source_surface);
+  free(job);
+}
+
+/* Whether the size can be scaled on the worker pool at all. Upscaling goes
+ * through cairo, which isn't safe to share across threads. */
+static bool can_scale_on_pool(struct surface_cache *cache, int new_width,
+                              int new_height) {
+  return cache->worker_pool != NULL && new_width > 0 && new_height > 0 &&
+         new_width <= cache->source_width &&
+         new_height <= cache->source_height;
+}
+
+static struct surface_cache_job *find_job(struct surface_cache *cache,
+                                          int new_width, int new_height) {
+  struct surface_cache_job *job;
+  wl_list_for_each(job, &cache->jobs, link) {
+    if (job->scaled_width == new_width && job->scaled_height == new_height) {
+      return job;
+    }
+  }
+  return NULL;
+}
+
+static void submit_job(struct surface_cache *cache, int new_width,
+                       int new_height, bool speculative) {
+  struct surface_cache_job *job = calloc(1, sizeof(struct surface_cache_job));
+  job->cache = cache;
+  /* Until the pyramid is built, this is the full-resolution source. */
+  job->source_surface = cairo_surface_reference(
+      pick_scale_source(cache, new_width, new_height));
+  job->scaled_surface =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
+  job->scaled_width = new_width;
+  job->scaled_height = new_height;
+  job->budget = cache->budget;
+  job->size = surface_size(job->scaled_surface);
+  job->speculative = speculative;
+  cairo_surface_flush(job->source_surface);
+  cairo_surface_flush(job->scaled_surface);
+
+  cache->budget->pending_bytes += job->size;
+  wl_list_insert(cache->jobs.prev, &job->link);
+  worker_pool_submit(cache->worker_pool, &job->worker_job, run_scale_job,
+                     handle_scale_job_done);
+}
+
+cairo_surface_t *surface_cache_request_scaled(struct surface_cache *cache,
+                                              int new_width, int new_height,
+                                              bool may_block) {
+  struct surface_cache_entry *p_surface_cache_entry =
+      find_cache_entry(cache, new_width, new_height);
+  if (p_surface_cache_entry != NULL) {
+    return p_surface_cache_entry->scaled_surface;
+  }
 
-  if (p_surface_cache_entry == NULL) {
-    // Create a new scaled surface
-    p_surface_cache_entry = &surface_cache_entry;
+  if (!can_scale_on_pool(cache, new_width, new_height)) {
+    return may_block ? surface_cache_get_scaled(cache, new_width, new_height)
+                     : NULL;
+  }
 
-    p_surface_cache_entry->scaled_surface =
-        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, new_width, new_height);
-    cairo_t *scaled_ctx = cairo_create(p_surface_cache_entry->scaled_surface);
+  struct surface_cache_job *job = find_job(cache, new_width, new_height);
+  if (job != NULL) {
+    /* Someone's waiting for it now. */
+    job->speculative = false;
+    return NULL;
+  }
+  submit_job(cache, new_width, new_height, false);
+  return NULL;
+}
 
-    // Calculate scaling factors
-    double scale_x = (double)new_width / cache->source_width;
-    double scale_y = (double)new_height / cache->source_height;
+bool surface_cache_prescale(struct surface_cache *cache, int new_width,
+                            int new_height) {
+  uint64_t key = cache_entry_key(new_width, new_height);
+  if (g_hash_table_lookup(cache->entries, &key) != NULL ||
+      !can_scale_on_pool(cache, new_width, new_height) ||
+      find_job(cache, new_width, new_height) != NULL) {
+    return true;
+  }
 
-    // Apply scaling and draw the source surface onto the scaled surface
-    cairo_scale(scaled_ctx, scale_x, scale_y);
-    cairo_set_source_surface(scaled_ctx, cache->source_surface, 0, 0);
-    cairo_paint(scaled_ctx);
+  struct surface_cache_budget *budget = cache->budget;
+  if (budget->bytes + budget->pending_bytes +
+          (size_t)new_width * new_height * 4 >
+      budget->max_bytes) {
+    return false;
+  }
+  submit_job(cache, new_width, new_height, true);
+  return true;
+}
+
+bool surface_cache_wants_direct(struct surface_cache *cache, int new_width,
+                                int new_height) {
+  if (new_width <= 0 || new_height <= 0 || new_width > cache->source_width ||
+      new_height > cache->source_height) {
+    return false;
+  }
+  /* Until the pyramid lands, this would be scaling the full-resolution
+   * source on this thread. */
+  if (cache->pyramid_job != NULL ||
+      find_cache_entry(cache, new_width, new_height) != NULL) {
+    return false;
+  }
+
+  struct surface_cache_job *job;
+  wl_list_for_each(job, &cache->jobs, link) {
+    if (job->scaled_width == new_width && job->scaled_height == new_height) {
+      return false;
+    }
+  }
 
-    cairo_destroy(scaled_ctx);
+  uint64_t key = cache_entry_key(new_width, new_height);
+  uint32_t num_keys = MIN(cache->num_direct_keys, SURFACE_CACHE_DIRECT_KEYS);
+  for (uint32_t i = 0; i < num_keys; i++) {
+    if (cache->direct_keys[i] == key) {
+      return false;
+    }
+  }
+  return true;
+}
 
-    // Update cache metadata
-    p_surface_cache_entry->scaled_width = new_width;
-    p_surface_cache_entry->scaled_height = new_height;
+bool surface_cache_scale_into(struct surface_cache *cache, int new_width,
+                              int new_height, cairo_surface_t *target, int x,
+                              int y, const cairo_rectangle_int_t *clip) {
+  if (!surface_cache_wants_direct(cache, new_width, new_height)) {
+    return false;
+  }
 
-    vec_append(cache->entries, p_surface_cache_entry);
+  /* Only the part of the scaled surface that's inside the clip and the
+   * target is drawn. */
+  int x1 = MAX(MAX(x, clip->x), 0);
+  int y1 = MAX(MAX(y, clip->y), 0);
+  int x2 = MIN(MIN(x + new_width, clip->x + clip->width),
+               cairo_image_surface_get_width(target));
+  int y2 = MIN(MIN(y + new_height, clip->y + clip->height),
+               cairo_image_surface_get_height(target));
+
+  build_levels_sync(cache);
+  cairo_surface_t *source_surface =
+      pick_scale_source(cache, new_width, new_height);
+  cairo_surface_flush(source_surface);
+  cairo_surface_flush(target);
+  if (x1 < x2 && y1 < y2) {
+    int stride = cairo_image_surface_get_stride(target);
+    uint8_t *dst = cairo_image_surface_get_data(target) +
+                   (size_t)y1 * stride + (size_t)x1 * 4;
+    if (!scale_area_average_over(
+            cairo_image_surface_get_data(source_surface),
+            cairo_image_surface_get_width(source_surface),
+            cairo_image_surface_get_height(source_surface),
+            cairo_image_surface_get_stride(source_surface), new_width,
+            new_height, x1 - x, y1 - y, x2 - x1, y2 - y1, dst, stride)) {
+      return false;
+    }
+    cairo_surface_mark_dirty_rectangle(target, x1, y1, x2 - x1, y2 - y1);
   }
 
-  return p_surface_cache_entry->scaled_surface;
+  cache->direct_keys[cache->num_direct_keys++ % SURFACE_CACHE_DIRECT_KEYS] =
+      cache_entry_key(new_width, new_height);
+  return true;
+}
+
+cairo_surface_t *surface_cache_get_fallback(struct surface_cache *cache,
+                                            int new_width, int new_height) {
+  return pick_scale_source(cache, new_width, new_height);
 }
@@ -2,7 +2,9 @@
 #define _SURFACE_BUFFER_H_
 
 #include "config.h"
+#include "worker_pool.h"
 #include <cairo/cairo.h>
+#include <glib.h>
 #include <pango/pangocairo.h>
 #include <wayland-client.h>
 
@@ -15,56 +17,224 @@ enum surface_buffer_state {
   SURFACE_BUFFER_BUSY =        2,
 };
 
+/* The pool starts out with no buffers, and grows up to its limit whenever
+ * every buffer is still held by the compositor. Buffers left unused for
+ * SURFACE_BUFFER_IDLE_MS are freed again, down to the usual two. */
+#define SURFACE_BUFFER_POOL_MAX_BUFFERS 8
+#define SURFACE_BUFFER_POOL_MIN_BUFFERS 2
+#define SURFACE_BUFFER_IDLE_MS 1000
+
+struct surface_buffer_pool;
+
 struct surface_buffer {
-  enum surface_buffer_state state;
-  struct wl_buffer          *wl_buffer;
-  cairo_surface_t           *cairo_surface;
-  cairo_t                   *cairo;
-  void                      *data;
-  PangoLayout               *pango_layout;
-  PangoContext              *pango_context;
-  size_t                    data_size;
-  uint32_t                  width;
-  uint32_t                  height;
+  enum surface_buffer_state  state;
+  struct surface_buffer_pool *pool;
+  struct wl_buffer           *wl_buffer;
+  cairo_surface_t            *cairo_surface;
+  cairo_t                    *cairo;
+  /* Where the buffer lives in the pool's shared memory. */
+  void                       *data;
+  size_t                     offset;
+  uint32_t                   stride;
+  uint32_t                   width;
+  uint32_t                   height;
+  /* Everything that changed since this buffer was last drawn to, which is
+   * all that has to be redrawn the next time it's used. */
+  cairo_region_t             *stale;
+  uint32_t                   last_used_ms;
 };
 
+typedef void (*surface_buffer_released_cb)(void *data);
+
 struct surface_buffer_pool {
-  struct surface_buffer buffers[2];
+  struct surface_buffer      buffers[SURFACE_BUFFER_POOL_MAX_BUFFERS];
+  uint32_t                   max_buffers;
+  /* The format of every buffer, as the compositor and cairo know it. */
+  uint32_t                   format;
+  cairo_format_t             cairo_format;
+
+  /* Every buffer is carved out of the same shared memory, one slot each,
+   * starting at slot_base. */
+  int                        shm_fd;
+  void                       *shm_data;
+  size_t                     shm_size;
+  struct wl_shm_pool         *wl_shm_pool;
+  size_t                     slot_base;
+  size_t                     slot_size;
+  /* Set when there's memory outside the slots, left there when they grew,
+   * that can be freed once no buffer uses it anymore. */
+  bool                       shm_reclaimable;
+
+  PangoContext               *pango_context;
+
+  /* Set when get_next_buffer() found every buffer busy. The next buffer the
+   * compositor releases calls `released_cb`, to try again. */
+  bool                       waiting;
+  surface_buffer_released_cb released_cb;
+  void                       *released_data;
 };
 
-void surface_buffer_pool_init(struct surface_buffer_pool *pool);
+/* Buffers of an `opaque` pool are XRGB8888, and whatever is drawn to them
+ * must be opaque too. */
+void surface_buffer_pool_init(struct surface_buffer_pool *pool,
+                              uint32_t max_buffers, bool opaque,
+                              surface_buffer_released_cb released_cb,
+                              void *released_data);
 void surface_buffer_pool_destroy(struct surface_buffer_pool *pool);
 
+/* Marks `damage` as stale in every buffer of the pool. */
+void surface_buffer_pool_damage(struct surface_buffer_pool *pool,
+                                const cairo_region_t *damage);
+
+/* Returns NULL if every buffer is busy and the pool can't grow, in which case
+ * the pool's released_cb is called once that changes. */
 struct surface_buffer *get_next_buffer(struct config *config,
                                        struct wl_shm *wl_shm,
                                        struct surface_buffer_pool *pool,
                                        uint32_t width, uint32_t height);
 
 /* The longest part of a render is scaling the surfaces. For near-fullscreen
- * surfaces at high resolution (3440x1440), I've seen them take upwards of 16ms.
- * Most of the time, we're scaling to the same surface to the exact same
- * dimensions anyway, so we'd like to use a cache. This functions exposes a
- * simple implementation of such a cache. */
+ * surfaces at high resolution (3440x1440), I've seen them take upwards of 16ms
+ * with cairo, and around 2ms with the downscaler in scale.h. Most of the time,
+ * we're scaling to the same surface to the exact same dimensions anyway, so
+ * we'd like to use a cache. This functions exposes a simple implementation of
+ * such a cache. */
+
+/* The scaled surfaces of every surface_cache count against one budget. When
+ * it's exceeded, the least recently used surfaces are evicted, whichever
+ * cache they're in. */
+struct surface_cache_budget {
+  /* Of surface_cache_entry, most recently used first. */
+  struct wl_list lru;
+  size_t         bytes;
+  size_t         max_bytes;
+  /* Scaled surfaces still being scaled on the worker pool. */
+  size_t         pending_bytes;
+  /* The pyramid levels of every cache. They live as long as their capture
+   * and can't be evicted, so they're tallied apart and don't count against
+   * max_bytes, or they'd crowd out the scaled surfaces. */
+  size_t         level_bytes;
+};
+
+void surface_cache_budget_init(struct surface_cache_budget *budget,
+                               size_t max_bytes);
 
 struct surface_cache_entry {
   cairo_surface_t *scaled_surface;
   int scaled_width;
   int scaled_height;
+
+  /* Packed scaled_width and scaled_height, keying the cache's hash table. */
+  uint64_t             key;
+  size_t               size;
+  struct surface_cache *cache;
+  struct wl_list       lru_link;
 };
 
+typedef void (*surface_cache_scaled_cb)(void *data, int scaled_width,
+                                        int scaled_height);
+
+/* How many sizes we remember having scaled straight into a frame. */
+#define SURFACE_CACHE_DIRECT_KEYS 4
+
+/* A pyramid of ever halving levels goes down to about this size. */
+#define SURFACE_CACHE_MAX_LEVELS 12
+#define SURFACE_CACHE_MIN_LEVEL_SIZE 32
+
+struct surface_cache_pyramid_job;
+
 struct surface_cache {
   cairo_surface_t *source_surface;
   int source_width;
   int source_height;
 
-  struct vec *entries;
+  /* Of surface_cache_entry, by their key. */
+  GHashTable                  *entries;
+  struct surface_cache_budget *budget;
+
+  /* The source at half, quarter, ... resolution, built once per capture.
+   * Every size is scaled from the smallest level still at least as big, so a
+   * miss costs a fraction of rescaling the full-resolution source. Levels are
+   * only ever set on the main thread, and are read-only from then on. */
+  cairo_surface_t                  *levels[SURFACE_CACHE_MAX_LEVELS];
+  uint32_t                         num_levels;
+  /* The bytes of all levels, in the budget's level_bytes. */
+  size_t                           levels_size;
+  bool                             levels_built;
+  struct surface_cache_pyramid_job *pyramid_job;
+
+  /* Sizes recently scaled straight into a frame without being kept, see
+   * surface_cache_scale_into(). */
+  uint64_t direct_keys[SURFACE_CACHE_DIRECT_KEYS];
+  uint32_t num_direct_keys;
+
+  /* Scaling happens on `worker_pool` when there is one. `jobs` are the ones
+   * still in flight, and `scaled_cb` is called as each one lands. */
+  struct worker_pool      *worker_pool;
+  struct wl_list          jobs;
+  surface_cache_scaled_cb scaled_cb;
+  void                    *scaled_cb_data;
 };
 
-struct surface_cache *surface_cache_init(cairo_surface_t *source_surface);
+/* `worker_pool` may be NULL, in which case everything is scaled synchronously.
+ * The source surface must not be modified while the cache uses it. */
+struct surface_cache *surface_cache_init(cairo_surface_t *source_surface,
+                                         struct surface_cache_budget *budget,
+                                         struct worker_pool *worker_pool,
+                                         surface_cache_scaled_cb scaled_cb,
+                                         void *scaled_cb_data);
 
 void surface_cache_destroy(struct surface_cache *cache);
 
+/* Points the cache at a new source surface with the same dimensions and
+ * content as the old one, keeping the already scaled surfaces. */
+void surface_cache_replace_source(struct surface_cache *cache,
+                                  cairo_surface_t *source_surface);
+
+/* Returns the source scaled to the given dimensions, scaling it right away if
+ * it isn't cached yet. */
 cairo_surface_t *surface_cache_get_scaled(struct surface_cache *cache,
                                           int new_width, int new_height);
 
+/* Like surface_cache_get_scaled(), but on a miss, queues the scaling on the
+ * worker pool and returns NULL. The cache's scaled_cb is called once the
+ * surface is ready. Sizes that can't be scaled on the pool are scaled right
+ * away, unless `may_block` is false, in which case NULL is returned and the
+ * caller has to ask again later. */
+cairo_surface_t *surface_cache_request_scaled(struct surface_cache *cache,
+                                              int new_width, int new_height,
+                                              bool may_block);
+
+/* Queues the given size on the worker pool in case it's needed soon, if it
+ * fits in the budget along with everything still being scaled. When it
+ * lands, it's kept only if that evicts nothing, and as the least recently
+ * used surface. Returns false if it doesn't fit. */
+bool surface_cache_prescale(struct surface_cache *cache, int new_width,
+                            int new_height);
+
+/* Whether surface_cache_scale_into() would draw the given size: a downscale
+ * that isn't cached, on its way from the worker pool, or asked for recently,
+ * with the pyramid already in. */
+bool surface_cache_wants_direct(struct surface_cache *cache, int new_width,
+                                int new_height);
+
+/* For a size the cache wants drawn directly, see above: scales the source
+ * straight into `target`, an image surface, with its top-left corner at
+ * (x, y) in device pixels, compositing it over what's there, but only within
+ * `clip`. That saves allocating a scaled surface and compositing it again, and
+ * with a worker pool, a frame spent showing a rough version while waiting for
+ * it, but nothing is kept. So that's only done the first time a size is asked
+ * for: a size that comes back is worth keeping, and for it, as for anything
+ * this can't do, this returns false and the caller should go through
+ * surface_cache_request_scaled(). */
+bool surface_cache_scale_into(struct surface_cache *cache, int new_width,
+                              int new_height, cairo_surface_t *target, int x,
+                              int y, const cairo_rectangle_int_t *clip);
+
+/* Something to draw, scaled by the caller, while the given size isn't cached:
+ * the smallest pyramid level that's still at least as big, or the source.
+ * This never scales anything. */
+cairo_surface_t *surface_cache_get_fallback(struct surface_cache *cache,
+                                            int new_width, int new_height);
+
 #endif /* _SURFACE_BUFFER_H_ */
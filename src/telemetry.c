@@ -0,0 +1,174 @@
+#include "telemetry.h"
+#include "log.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Bucket i holds latencies in [2^i, 2^(i+1)) microseconds, except the first,
+ * which also holds 0, and the last, which holds everything above. */
+#define TELEMETRY_NUM_BUCKETS 26
+
+struct histogram {
+  uint32_t buckets[TELEMETRY_NUM_BUCKETS];
+  uint32_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+};
+
+static const char *const stage_names[TELEMETRY_NUM_STAGES] = {
+    [TELEMETRY_STAGE_REQUESTED] = "requested",
+    [TELEMETRY_STAGE_BUFFER] = "buffer",
+    [TELEMETRY_STAGE_BUFFER_DONE] = "buffer_done",
+    [TELEMETRY_STAGE_COPY] = "copy",
+    [TELEMETRY_STAGE_READY] = "ready",
+    [TELEMETRY_STAGE_FAILED] = "failed",
+    [TELEMETRY_STAGE_SCALED] = "scaled",
+};
+
+static const char *const failure_names[TELEMETRY_NUM_FAILURES] = {
+    [TELEMETRY_FAILURE_COPY] = "copy failed",
+    [TELEMETRY_FAILURE_FORMAT] = "no usable format",
+    [TELEMETRY_FAILURE_ALLOC] = "buffer allocation",
+    [TELEMETRY_FAILURE_GAVE_UP] = "gave up",
+};
+
+/* Time since the previous stage of the same capture. */
+static struct histogram step_histograms[TELEMETRY_NUM_STAGES];
+/* Time since the capture was requested. */
+static struct histogram total_histograms[TELEMETRY_NUM_STAGES];
+static uint32_t failures[TELEMETRY_NUM_FAILURES];
+/* Captures are timed on the capture thread, and drawn on the main thread. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t print_requested = 0;
+
+static uint64_t gettime_us(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void histogram_add(struct histogram *histogram, uint64_t us) {
+  uint32_t bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+  if (bucket >= TELEMETRY_NUM_BUCKETS) {
+    bucket = TELEMETRY_NUM_BUCKETS - 1;
+  }
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->sum_us += us;
+  if (us > histogram->max_us) {
+    histogram->max_us = us;
+  }
+}
+
+/* Upper bound of the bucket the given percentile falls in. */
+static uint64_t histogram_percentile(const struct histogram *histogram,
+                                     uint32_t percentile) {
+  uint64_t rank = ((uint64_t)histogram->count * percentile + 99) / 100;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < TELEMETRY_NUM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = (uint64_t)2 << i;
+      return bound < histogram->max_us ? bound : histogram->max_us;
+    }
+  }
+  return histogram->max_us;
+}
+
+static void print_histogram(const char *name,
+                            const struct histogram *histogram) {
+  if (histogram->count == 0) {
+    return;
+  }
+  log_info("%-13s %6u %10.2f %10.2f %10.2f %10.2f\n", name, histogram->count,
+           histogram->sum_us / (double)histogram->count / 1000.0,
+           histogram_percentile(histogram, 50) / 1000.0,
+           histogram_percentile(histogram, 90) / 1000.0,
+           histogram->max_us / 1000.0);
+}
+
+static void handle_sigusr1(int signum) { print_requested = 1; }
+
+void telemetry_init(void) {
+  /* poll() is interrupted either way, so the summary is printed right away.
+   * SA_RESTART keeps blocking calls elsewhere, like reading the Hyprland IPC
+   * socket, from being cut short. */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_sigusr1;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+void telemetry_capture_requested(struct telemetry_capture *capture) {
+  memset(capture, 0, sizeof(struct telemetry_capture));
+  capture->last_us = capture->stage_us[TELEMETRY_STAGE_REQUESTED] =
+      gettime_us();
+  pthread_mutex_lock(&lock);
+  step_histograms[TELEMETRY_STAGE_REQUESTED].count++;
+  total_histograms[TELEMETRY_STAGE_REQUESTED].count++;
+  pthread_mutex_unlock(&lock);
+}
+
+void telemetry_mark(struct telemetry_capture *capture,
+                    enum telemetry_stage stage) {
+  /* Either we never saw the request, or this stage was already recorded. */
+  if (capture->stage_us[TELEMETRY_STAGE_REQUESTED] == 0 ||
+      capture->stage_us[stage] != 0) {
+    return;
+  }
+
+  uint64_t now_us = gettime_us();
+  capture->stage_us[stage] = now_us;
+  pthread_mutex_lock(&lock);
+  histogram_add(&step_histograms[stage], now_us - capture->last_us);
+  histogram_add(&total_histograms[stage],
+                now_us - capture->stage_us[TELEMETRY_STAGE_REQUESTED]);
+  pthread_mutex_unlock(&lock);
+  capture->last_us = now_us;
+}
+
+void telemetry_failure(enum telemetry_failure failure) {
+  pthread_mutex_lock(&lock);
+  failures[failure]++;
+  pthread_mutex_unlock(&lock);
+}
+
+void telemetry_print(void) {
+  pthread_mutex_lock(&lock);
+  log_info("Capture telemetry, in ms:\n");
+  log_indent();
+  log_info("%-13s %6s %10s %10s %10s %10s\n", "since prev", "count", "mean",
+           "p50", "p90", "max");
+  for (uint32_t i = TELEMETRY_STAGE_REQUESTED + 1; i < TELEMETRY_NUM_STAGES;
+       i++) {
+    print_histogram(stage_names[i], &step_histograms[i]);
+  }
+  log_info("%-13s %6s %10s %10s %10s %10s\n", "since request", "count",
+           "mean", "p50", "p90", "max");
+  for (uint32_t i = TELEMETRY_STAGE_REQUESTED + 1; i < TELEMETRY_NUM_STAGES;
+       i++) {
+    print_histogram(stage_names[i], &total_histograms[i]);
+  }
+
+  log_info("%u captures requested\n",
+           step_histograms[TELEMETRY_STAGE_REQUESTED].count);
+  for (uint32_t i = 0; i < TELEMETRY_NUM_FAILURES; i++) {
+    if (failures[i] > 0) {
+      log_info("%u x %s\n", failures[i], failure_names[i]);
+    }
+  }
+  log_unindent();
+  pthread_mutex_unlock(&lock);
+}
+
+void telemetry_handle_signals(void) {
+  if (print_requested) {
+    print_requested = 0;
+    telemetry_print();
+  }
+}
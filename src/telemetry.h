@@ -0,0 +1,62 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Where each capture spends its time on the way from being requested to being
+ * on screen. Every stage a capture reaches is timestamped, and the time since
+ * the previous stage and since the request go into per-stage log2 histograms.
+ * With --telemetry, the summary is printed on exit, and any time on SIGUSR1.
+ * Marks and failures can come from any thread. */
+
+enum telemetry_stage {
+  TELEMETRY_STAGE_REQUESTED,
+  TELEMETRY_STAGE_BUFFER,
+  TELEMETRY_STAGE_BUFFER_DONE,
+  TELEMETRY_STAGE_COPY,
+  TELEMETRY_STAGE_READY,
+  TELEMETRY_STAGE_FAILED,
+  TELEMETRY_STAGE_SCALED,
+  TELEMETRY_NUM_STAGES,
+};
+
+enum telemetry_failure {
+  /* The compositor sent "failed" for a copy. */
+  TELEMETRY_FAILURE_COPY,
+  /* None of the offered buffer formats were usable. */
+  TELEMETRY_FAILURE_FORMAT,
+  /* We couldn't allocate or map the buffer to copy into. */
+  TELEMETRY_FAILURE_ALLOC,
+  /* We ran out of retries. */
+  TELEMETRY_FAILURE_GAVE_UP,
+  TELEMETRY_NUM_FAILURES,
+};
+
+/* Meant to be embedded in whatever is being captured. */
+struct telemetry_capture {
+  uint64_t stage_us[TELEMETRY_NUM_STAGES];
+  uint64_t last_us;
+};
+
+/* Installs the SIGUSR1 handler. */
+void telemetry_init(void);
+
+/* Starts timing a new capture, forgetting about the previous one. */
+void telemetry_capture_requested(struct telemetry_capture *capture);
+
+/* Records that the capture reached `stage`. Only the first time a capture
+ * reaches a stage counts, so this is safe to call for every "buffer" event or
+ * every time the capture is drawn. */
+void telemetry_mark(struct telemetry_capture *capture,
+                    enum telemetry_stage stage);
+
+void telemetry_failure(enum telemetry_failure failure);
+
+/* Prints the histograms and failure counts collected so far. */
+void telemetry_print(void);
+
+/* Prints the summary if SIGUSR1 arrived since the last call. */
+void telemetry_handle_signals(void);
+
+#endif /* _TELEMETRY_H_ */
@@ -0,0 +1,77 @@
+#include "text_layout.h"
+#include <glib.h>
+#include <string.h>
+
+static void clear_split(struct text_layout *text_layout) {
+  if (text_layout->highlighted) {
+    g_object_unref(text_layout->highlighted);
+  }
+  if (text_layout->rest) {
+    g_object_unref(text_layout->rest);
+  }
+  text_layout->highlighted = NULL;
+  text_layout->rest = NULL;
+  text_layout->split = false;
+}
+
+void text_layout_update(struct text_layout *text_layout, PangoContext *context,
+                        const char *text, int32_t wrap_width) {
+  if (text_layout->layout != NULL && text_layout->context == context &&
+      text_layout->wrap_width == wrap_width &&
+      strcmp(text_layout->text, text) == 0) {
+    return;
+  }
+
+  text_layout_destroy(text_layout);
+  text_layout->context = context;
+  text_layout->text = g_strdup(text);
+  text_layout->wrap_width = wrap_width;
+
+  text_layout->layout = pango_layout_new(context);
+  pango_layout_set_text(text_layout->layout, text, -1);
+  pango_layout_set_width(text_layout->layout, wrap_width * PANGO_SCALE);
+  pango_layout_get_pixel_extents(text_layout->layout, &text_layout->ink_rect,
+                                 &text_layout->logical_rect);
+  /* Drawn in exactly the room it takes, which doesn't wrap it any
+   * differently. */
+  pango_layout_set_width(text_layout->layout,
+                         text_layout->logical_rect.width * PANGO_SCALE);
+}
+
+static PangoLayout *create_part(struct text_layout *text_layout,
+                                const char *text, int length) {
+  PangoLayout *layout = pango_layout_new(text_layout->context);
+  pango_layout_set_text(layout, text, length);
+  pango_layout_set_width(layout, text_layout->wrap_width * PANGO_SCALE);
+  return layout;
+}
+
+void text_layout_split(struct text_layout *text_layout,
+                       uint32_t highlight_len) {
+  if (text_layout->split && text_layout->highlight_len == highlight_len) {
+    return;
+  }
+
+  clear_split(text_layout);
+  uint32_t split_at = MIN(highlight_len, strlen(text_layout->text));
+  text_layout->highlighted =
+      create_part(text_layout, text_layout->text, split_at);
+  text_layout->rest =
+      create_part(text_layout, &text_layout->text[split_at], -1);
+
+  PangoRectangle logical_rect;
+  pango_layout_get_pixel_extents(text_layout->highlighted, NULL,
+                                 &logical_rect);
+  text_layout->highlighted_width = logical_rect.width;
+  text_layout->highlight_len = highlight_len;
+  text_layout->split = true;
+}
+
+void text_layout_destroy(struct text_layout *text_layout) {
+  clear_split(text_layout);
+  if (text_layout->layout) {
+    g_object_unref(text_layout->layout);
+  }
+  g_free(text_layout->text);
+  memset(text_layout, 0, sizeof(struct text_layout));
+}
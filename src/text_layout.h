@@ -0,0 +1,44 @@
+#ifndef _TEXT_LAYOUT_H_
+#define _TEXT_LAYOUT_H_
+
+#include <pango/pangocairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A piece of text shaped once and kept across frames. Shaping is by far the
+ * most expensive part of drawing text, and titles and shortcuts hardly ever
+ * change, so each one is only laid out again when its text, the width it's
+ * wrapped to or the length of its highlighted prefix changes. */
+struct text_layout {
+  PangoContext   *context;
+  char           *text;
+  /* The width the text is wrapped to, in pixels. */
+  int32_t        wrap_width;
+
+  /* The whole text, for measuring it and for drawing it unhighlighted. */
+  PangoLayout    *layout;
+  PangoRectangle ink_rect;
+  PangoRectangle logical_rect;
+
+  /* The text split after its first highlight_len bytes, for drawing it
+   * highlighted. */
+  bool           split;
+  uint32_t       highlight_len;
+  PangoLayout    *highlighted;
+  PangoLayout    *rest;
+  int32_t        highlighted_width;
+};
+
+/* Makes sure `text_layout` holds `text` wrapped to `wrap_width` pixels. Does
+ * nothing if it already does. */
+void text_layout_update(struct text_layout *text_layout, PangoContext *context,
+                        const char *text, int32_t wrap_width);
+
+/* Makes sure the text is split after its first `highlight_len` bytes. Must be
+ * called after text_layout_update(). */
+void text_layout_split(struct text_layout *text_layout,
+                       uint32_t highlight_len);
+
+void text_layout_destroy(struct text_layout *text_layout);
+
+#endif /* _TEXT_LAYOUT_H_ */
@@ -0,0 +1,254 @@
+#include "thumbnail_cache.h"
+#include "log.h"
+#include "qoi.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define THUMBNAIL_CACHE_PATH_MAX_LEN 4096
+#define THUMBNAIL_CACHE_EXTENSION ".qoi"
+
+/* Writes the cache directory into `into`, creating it if `create` is set. */
+static bool get_cache_dir(char *into, size_t len, bool create) {
+  const char *base_dir = getenv("XDG_CACHE_HOME");
+  const char *ext = "";
+  if (base_dir == NULL || *base_dir == '\0') {
+    base_dir = getenv("HOME");
+    ext = "/.cache";
+    if (base_dir == NULL) {
+      log_debug("Couldn't find XDG_CACHE_HOME or HOME envvars\n");
+      return false;
+    }
+  }
+
+  if (create) {
+    snprintf(into, len, "%s%s", base_dir, ext);
+    if (mkdir(into, 0700) < 0 && errno != EEXIST) {
+      return false;
+    }
+  }
+  snprintf(into, len, "%s%s/peekaboo", base_dir, ext);
+  if (create && mkdir(into, 0700) < 0 && errno != EEXIST) {
+    log_debug("Couldn't create thumbnail cache directory %s\n", into);
+    return false;
+  }
+  return true;
+}
+
+static bool get_thumbnail_path(char *into, size_t len, uint64_t client_id,
+                               uint32_t box_width, uint32_t box_height,
+                               bool create) {
+  char dir[THUMBNAIL_CACHE_PATH_MAX_LEN];
+  if (!get_cache_dir(dir, sizeof(dir), create)) {
+    return false;
+  }
+  snprintf(into, len, "%s/%016" PRIx64 "-%ux%u" THUMBNAIL_CACHE_EXTENSION, dir,
+           client_id, box_width, box_height);
+  return true;
+}
+
+static uint8_t *read_file(const char *path, size_t *out_size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  uint8_t *data = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = malloc(st.st_size);
+    size_t read_size = 0;
+    while (data != NULL && read_size < (size_t)st.st_size) {
+      ssize_t n = read(fd, data + read_size, st.st_size - read_size);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        free(data);
+        data = NULL;
+        break;
+      }
+      read_size += n;
+    }
+    *out_size = read_size;
+  }
+
+  close(fd);
+  return data;
+}
+
+static bool write_file(const char *path, const uint8_t *data, size_t size) {
+  /* Write to a temporary file first so we never leave a half-written
+   * thumbnail behind for the next launch to trip on. */
+  char tmp_path[THUMBNAIL_CACHE_PATH_MAX_LEN + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, data + written, size - written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      close(fd);
+      unlink(tmp_path);
+      return false;
+    }
+    written += n;
+  }
+  close(fd);
+
+  if (rename(tmp_path, path) < 0) {
+    unlink(tmp_path);
+    return false;
+  }
+  return true;
+}
+
+cairo_surface_t *thumbnail_cache_load(uint64_t client_id, uint32_t box_width,
+                                      uint32_t box_height) {
+  char path[THUMBNAIL_CACHE_PATH_MAX_LEN];
+  if (!get_thumbnail_path(path, sizeof(path), client_id, box_width,
+                          box_height, false)) {
+    return NULL;
+  }
+
+  size_t size;
+  uint8_t *data = read_file(path, &size);
+  if (data == NULL) {
+    return NULL;
+  }
+
+  cairo_surface_t *thumbnail = NULL;
+  uint32_t width, height;
+  /* A thumbnail can never be bigger than the box it's drawn in. */
+  if (qoi_read_header(data, size, &width, &height) && width <= box_width &&
+      height <= box_height) {
+    thumbnail = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_surface_flush(thumbnail);
+    if (!qoi_decode(data, size, cairo_image_surface_get_data(thumbnail), width,
+                    height, cairo_image_surface_get_stride(thumbnail))) {
+      cairo_surface_destroy(thumbnail);
+      thumbnail = NULL;
+    } else {
+      cairo_surface_mark_dirty(thumbnail);
+    }
+  }
+
+  if (thumbnail == NULL) {
+    log_debug("Discarding invalid cached thumbnail %s\n", path);
+    unlink(path);
+  }
+
+  free(data);
+  return thumbnail;
+}
+
+/* Reads the client id out of a file name, if it's a name we could have
+ * written ourselves. */
+static bool parse_thumbnail_name(const char *name, uint64_t *client_id) {
+  char *end;
+  *client_id = strtoull(name, &end, 16);
+  return end != name && *end == '-' &&
+         strstr(end, THUMBNAIL_CACHE_EXTENSION) != NULL;
+}
+
+/* A window is only ever shown at one box size at a time, so once it's stored
+ * at a new one, the thumbnails of the sizes it was shown at before are of no
+ * use anymore. */
+static void remove_other_sizes(const char *path, uint64_t client_id) {
+  char dir_path[THUMBNAIL_CACHE_PATH_MAX_LEN];
+  if (!get_cache_dir(dir_path, sizeof(dir_path), false)) {
+    return;
+  }
+
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    return;
+  }
+
+  const char *kept_name = strrchr(path, '/') + 1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    uint64_t entry_client_id;
+    if (parse_thumbnail_name(entry->d_name, &entry_client_id) &&
+        entry_client_id == client_id && strcmp(entry->d_name, kept_name) != 0) {
+      log_debug("Removing outdated thumbnail %s\n", entry->d_name);
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+
+  closedir(dir);
+}
+
+bool thumbnail_cache_store(uint64_t client_id, uint32_t box_width,
+                           uint32_t box_height, cairo_surface_t *thumbnail) {
+  char path[THUMBNAIL_CACHE_PATH_MAX_LEN];
+  if (!get_thumbnail_path(path, sizeof(path), client_id, box_width,
+                          box_height, true)) {
+    return false;
+  }
+
+  cairo_surface_flush(thumbnail);
+  size_t size;
+  uint8_t *data = qoi_encode(cairo_image_surface_get_data(thumbnail),
+                             cairo_image_surface_get_width(thumbnail),
+                             cairo_image_surface_get_height(thumbnail),
+                             cairo_image_surface_get_stride(thumbnail), &size);
+  if (data == NULL) {
+    return false;
+  }
+
+  bool status = write_file(path, data, size);
+  if (status) {
+    remove_other_sizes(path, client_id);
+  } else {
+    log_debug("Couldn't write thumbnail %s\n", path);
+  }
+  free(data);
+  return status;
+}
+
+void thumbnail_cache_collect_garbage(const uint64_t *client_ids,
+                                     size_t num_client_ids) {
+  char dir_path[THUMBNAIL_CACHE_PATH_MAX_LEN];
+  if (!get_cache_dir(dir_path, sizeof(dir_path), false)) {
+    return;
+  }
+
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    /* Only ever touch files we could have written ourselves. */
+    uint64_t client_id;
+    if (!parse_thumbnail_name(entry->d_name, &client_id)) {
+      continue;
+    }
+
+    bool alive = false;
+    for (size_t i = 0; i < num_client_ids && !alive; i++) {
+      alive = client_ids[i] == client_id;
+    }
+    if (!alive) {
+      log_debug("Removing thumbnail of closed window %s\n", entry->d_name);
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+
+  closedir(dir);
+}
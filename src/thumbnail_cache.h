@@ -0,0 +1,28 @@
+#ifndef _THUMBNAIL_CACHE_H_
+#define _THUMBNAIL_CACHE_H_
+
+#include <cairo.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Captures take a while to come in, so until they do, we show the thumbnail
+ * we drew for the same window the last time we were launched. Thumbnails are
+ * kept as QOI images in $XDG_CACHE_HOME/peekaboo, keyed by the client's id
+ * and the size of the box they were previewed in. */
+
+/* Returns a new ARGB32 surface with the cached thumbnail, or NULL if there's
+ * no (valid) cached thumbnail for this client and box size. */
+cairo_surface_t *thumbnail_cache_load(uint64_t client_id, uint32_t box_width,
+                                      uint32_t box_height);
+
+/* Also deletes the client's thumbnails for any other box size. */
+bool thumbnail_cache_store(uint64_t client_id, uint32_t box_width,
+                           uint32_t box_height, cairo_surface_t *thumbnail);
+
+/* Deletes the cached thumbnails of every client that isn't in `client_ids`,
+ * i.e. windows that have since been closed. */
+void thumbnail_cache_collect_garbage(const uint64_t *client_ids,
+                                     size_t num_client_ids);
+
+#endif /* _THUMBNAIL_CACHE_H_ */
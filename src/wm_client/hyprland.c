@@ -1,8 +1,11 @@
 // vim:foldmethod=marker
 #include "hyprland.h"
+#include "../capture_thread.h"
 #include "../log.h"
 #include "../peekaboo.h"
+#include "../pixel.h"
 #include "../shm.h"
+#include "../telemetry.h"
 #include "assert.h"
 #include "cairo.h"
 #include "hyprland-toplevel-export-v1.h"
@@ -15,9 +18,14 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <viewporter.h>
 #include <wayland-client-core.h>
 #include <wayland-util.h>
 
+/* A failed capture is retried after 8ms, 16ms, 32ms, ... */
+#define HYPRLAND_CAPTURE_MAX_ATTEMPTS 5
+#define HYPRLAND_CAPTURE_RETRY_BASE_MS 8
+
 static void noop() {}
 
 char *send_hyprland_socket(const char *command) {
@@ -90,138 +98,228 @@ char *send_hyprland_socket(const char *command) {
 }
 
 // hyprland_toplevel_export_frame {{{
+/* Once a capture is ready, the cairo surface wrapping it owns its mapping.
+ * That way, it stays alive for as long as anyone (e.g. a scaling job) holds a
+ * reference to the surface, even after we've moved on to the next capture. */
+struct capture_mapping {
+  void   *data;
+  size_t size;
+};
+
+static const cairo_user_data_key_t capture_mapping_key;
+
+static void unmap_capture(void *data) {
+  struct capture_mapping *mapping = data;
+  munmap(mapping->data, mapping->size);
+  free(mapping);
+}
+
+static void handle_client_scaled(void *data, int scaled_width,
+                                 int scaled_height) {
+  struct wm_client *wm_client = data;
+  /* Surfaces scaled ahead of time for a layout we aren't showing yet don't
+   * need a frame. */
+  if (wm_client->hide || scaled_width != wm_client->preview_thumbnail_width ||
+      scaled_height != wm_client->preview_thumbnail_height) {
+    return;
+  }
+  wm_client->peekaboo->request_frame(wm_client->peekaboo);
+}
+
+/* A capture on its way. The capture thread owns it from the moment it's
+ * submitted until it's handed back to handle_capture_done(), so none of this
+ * lives in the wm_client, which the main thread keeps rendering meanwhile. */
+enum hyprland_capture_result {
+  HYPRLAND_CAPTURE_READY,
+  /* The compositor sent "failed". */
+  HYPRLAND_CAPTURE_FAILED,
+  HYPRLAND_CAPTURE_NO_FORMAT,
+  HYPRLAND_CAPTURE_NO_MEMORY,
+  HYPRLAND_CAPTURE_NO_CONVERSION,
+};
+
+struct hyprland_capture {
+  struct capture_item                      item;
+  struct wm_client                         *wm_client;
+  struct hyprland_toplevel_export_frame_v1 *frame;
+
+  /* Every "buffer" event received so far. */
+  struct wm_client_buffer_offer offers[WM_CLIENT_MAX_BUFFER_OFFERS];
+  uint32_t                      num_offers;
+
+  uint32_t                                 width;
+  uint32_t                                 height;
+  uint32_t                                 stride;
+  uint32_t                                 format;
+  void                                     *buf;
+  struct wl_buffer                         *wl_buffer;
+  /* The same memory as ARGB8888, for subsurface previews. */
+  struct wl_buffer                         *preview_wl_buffer;
+  uint64_t                                 hash;
+
+  enum hyprland_capture_result             result;
+  struct telemetry_capture                 telemetry;
+};
+
+static void free_capture(struct hyprland_capture *capture) {
+  if (capture->frame) {
+    hyprland_toplevel_export_frame_v1_destroy(capture->frame);
+  }
+  /* Do I need to destroy the wl_buffer before unmapping buf? I don't know,
+   * but I'll do it anyway. */
+  if (capture->wl_buffer) {
+    wl_buffer_destroy(capture->wl_buffer);
+  }
+  if (capture->preview_wl_buffer) {
+    wl_buffer_destroy(capture->preview_wl_buffer);
+  }
+  /* Buffers of captures that made it to the screen belong to their
+   * orig_surface by now. */
+  if (capture->buf) {
+    munmap(capture->buf, capture->height * capture->stride);
+  }
+  free(capture);
+}
+
+/* Called on the capture thread once the frame has nothing more to say. */
+static void finish_capture(struct hyprland_capture *capture,
+                           enum hyprland_capture_result result) {
+  struct peekaboo *peekaboo = capture->wm_client->peekaboo;
+  capture->result = result;
+  hyprland_toplevel_export_frame_v1_destroy(capture->frame);
+  capture->frame = NULL;
+  capture_thread_finish(&peekaboo->capture_thread, &capture->item);
+}
+
 static void handle_hyprland_toplevel_export_frame_buffer(
     void *data,
     struct hyprland_toplevel_export_frame_v1 *hyprland_toplevel_export_frame,
     uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
-  struct peekaboo *peekaboo = data;
-
-  /*
-   * I didn't realize this when I started implementing, but presumably, more
-   * than one "buffer" event indicates multiple buffer parameters that this
-   * export_frame can use, and we can choose which one we want.
-   * The current implementation will take only the last buffer event to use
-   * for the buffer parameters. I've only seen each export_frame send one
-   * buffer event, but we should probably handle multiple buffer events.
-   *
-   * TODO: (Maybe) Handle multiple buffer events
-   */
+  struct hyprland_capture *capture = data;
+  telemetry_mark(&capture->telemetry, TELEMETRY_STAGE_BUFFER);
+
+  /* More than one "buffer" event means the export frame can be copied into
+   * any of the advertised buffer parameters. Collect all of them and choose
+   * once we've received "buffer_done". */
+  if (capture->num_offers == WM_CLIENT_MAX_BUFFER_OFFERS) {
+    log_warning("Too many buffer formats offered for %s, ignoring 0x%x\n",
+                capture->wm_client->title, format);
+    return;
+  }
 
-  struct wm_client *wm_client;
-  struct hyprland_client *hyprland_client;
-  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
-    hyprland_client = wm_client->client;
-    if (hyprland_client->toplevel_export_frame ==
-        hyprland_toplevel_export_frame) {
-
-      /* Do I need to destroy the wl_buffer before unmapping buf? I don't know,
-       * but I'll do it anyway. */
-      if (wm_client->wl_buffer != NULL) {
-        wl_buffer_destroy(wm_client->wl_buffer);
-        wm_client->wl_buffer = NULL;
-      }
+  capture->offers[capture->num_offers++] = (struct wm_client_buffer_offer){
+      .format = format,
+      .width = width,
+      .height = height,
+      .stride = stride,
+  };
+}
 
-      /* If we're updating an existing client, this is really the best time to
-       * free the buffer because after we set the (possibly new) buffer
-       * parameters, we'll lose track of what to unmap. */
-      if (wm_client->buf != NULL) {
-        munmap(wm_client->buf, wm_client->height * wm_client->stride);
-        wm_client->buf = NULL;
-      }
+/* Chooses the offered buffer parameters that are cheapest to turn into our
+ * render format. Returns false if none of the offered formats are usable. */
+static bool pick_buffer_offer(struct hyprland_capture *capture) {
+  uint32_t formats[WM_CLIENT_MAX_BUFFER_OFFERS];
+  for (uint32_t i = 0; i < capture->num_offers; i++) {
+    formats[i] = capture->offers[i].format;
+  }
 
-      /* Fill in the export_frame's fields for copying. */
-      wm_client->width = width;
-      wm_client->height = height;
-      wm_client->stride = stride;
-      wm_client->format = format;
-    }
+  int32_t index = pixel_format_pick(formats, capture->num_offers);
+  if (index < 0) {
+    return false;
   }
+
+  /* Fill in the export_frame's fields for copying. */
+  const struct wm_client_buffer_offer *offer = &capture->offers[index];
+  capture->width = offer->width;
+  capture->height = offer->height;
+  capture->stride = offer->stride;
+  capture->format = offer->format;
+  return true;
 }
 
 void handle_hyprland_toplevel_export_frame_buffer_done(
     void *data,
     struct hyprland_toplevel_export_frame_v1 *hyprland_toplevel_export_frame) {
-  struct peekaboo *peekaboo = data;
-  struct wm_client *wm_client;
-  struct hyprland_client *hyprland_client;
-  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
-    hyprland_client = wm_client->client;
-
-    if (hyprland_client->toplevel_export_frame ==
-        hyprland_toplevel_export_frame) {
-      uint32_t width = wm_client->width;
-      uint32_t height = wm_client->height;
-      uint32_t stride = wm_client->stride;
-      uint32_t format = wm_client->format;
-      uint32_t data_size = wm_client->height * wm_client->stride;
-
-      int fd = shm_allocate_file(data_size);
-      if (fd < 0) {
-        log_error("Failed to allocate file descriptor\n");
-        return;
-      }
+  struct hyprland_capture *capture = data;
+  struct peekaboo *peekaboo = capture->wm_client->peekaboo;
+  telemetry_mark(&capture->telemetry, TELEMETRY_STAGE_BUFFER_DONE);
 
-      wm_client->buf =
-          mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-      if ((int64_t)wm_client->buf < 0) {
-        log_error("Failed to memory map buffer\n");
-        return;
-      }
+  if (!pick_buffer_offer(capture)) {
+    finish_capture(capture, HYPRLAND_CAPTURE_NO_FORMAT);
+    return;
+  }
 
-      /* Ideally, I'd like to just reuse the same shm pool and fd, but I've
-       * had a lot of trouble getting it to work.
-       * TODO: Use a single wl_shm_pool. */
-      struct wl_shm_pool *wl_shm_pool =
-          wl_shm_create_pool(peekaboo->wl_shm, fd, data_size);
-      wm_client->wl_buffer = wl_shm_pool_create_buffer(wl_shm_pool, 0, width,
-                                                       height, stride, format);
-      hyprland_toplevel_export_frame_v1_copy(hyprland_toplevel_export_frame,
-                                             wm_client->wl_buffer, false);
-
-      /* Cleanup */
-      wl_shm_pool_destroy(wl_shm_pool);
-      close(fd);
-    }
+  uint32_t width = capture->width;
+  uint32_t height = capture->height;
+  uint32_t stride = capture->stride;
+  uint32_t format = capture->format;
+  uint32_t data_size = height * stride;
+
+  int fd = shm_allocate_file(data_size);
+  if (fd < 0) {
+    finish_capture(capture, HYPRLAND_CAPTURE_NO_MEMORY);
+    return;
+  }
+
+  void *buf = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buf == MAP_FAILED) {
+    close(fd);
+    finish_capture(capture, HYPRLAND_CAPTURE_NO_MEMORY);
+    return;
+  }
+  capture->buf = buf;
+
+  /* Ideally, I'd like to just reuse the same shm pool and fd, but I've
+   * had a lot of trouble getting it to work.
+   * TODO: Use a single wl_shm_pool. */
+  struct wl_shm_pool *wl_shm_pool =
+      wl_shm_create_pool(peekaboo->wl_shm, fd, data_size);
+  capture->wl_buffer = wl_shm_pool_create_buffer(wl_shm_pool, 0, width, height,
+                                                 stride, format);
+  /* Once it's converted, the same memory is what we show in the preview's
+   * subsurface. */
+  if (peekaboo->subsurface_previews) {
+    capture->preview_wl_buffer = wl_shm_pool_create_buffer(
+        wl_shm_pool, 0, width, height, stride, WL_SHM_FORMAT_ARGB8888);
   }
+  hyprland_toplevel_export_frame_v1_copy(hyprland_toplevel_export_frame,
+                                         capture->wl_buffer, false);
+  telemetry_mark(&capture->telemetry, TELEMETRY_STAGE_COPY);
+
+  /* Cleanup */
+  wl_shm_pool_destroy(wl_shm_pool);
+  close(fd);
 }
 
-/* Called when copying the export_frame is finished. */
+/* Called when copying the export_frame is finished. Converting and hashing
+ * are a pass over every pixel each, so they stay on the capture thread too. */
 void handle_hyprland_toplevel_export_frame_ready(
     void *data,
     struct hyprland_toplevel_export_frame_v1 *hyprland_toplevel_export_frame,
     uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-  struct peekaboo *peekaboo = data;
-
-  struct wm_client *wm_client;
-  struct hyprland_client *hyprland_client;
-  wl_list_for_each(wm_client, &peekaboo->wm_clients, link) {
-    hyprland_client = wm_client->client;
-    if (hyprland_client->toplevel_export_frame ==
-        hyprland_toplevel_export_frame) {
-      if (wm_client->surface_cache) {
-        surface_cache_destroy(wm_client->surface_cache);
-      }
-      if (wm_client->orig_surface) {
-        cairo_surface_destroy(wm_client->orig_surface);
-      }
+  struct hyprland_capture *capture = data;
+  telemetry_mark(&capture->telemetry, TELEMETRY_STAGE_READY);
 
-      // TODO: Check the format is compatible
-      wm_client->orig_surface = cairo_image_surface_create_for_data(
-          wm_client->buf, CAIRO_FORMAT_ARGB32, wm_client->width,
-          wm_client->height, wm_client->stride);
-      wm_client->surface_cache = surface_cache_init(wm_client->orig_surface);
-      wm_client->ready = true;
-
-      peekaboo->request_frame(peekaboo);
-      /* Refreshing currently doesn't work. We may try to render a frame while
-       * requesting the new buffer. In doing so, we release or otherwise modify
-       * resources needed for rendering the frame, causing flickering at best,
-       * and a segfault at worst. If we want to implement this a way to refresh
-       * windows, we should implement double-buffering on the wm_client
-       * buffers. Or, maybe if we memcpy the shm buffer into our own buffer? */
-      /* hyprland_clients_refresh(peekaboo, &peekaboo->wm_clients); */
-    }
+  /* Whatever format we picked, cairo only gets to see ARGB32. */
+  if (!pixel_convert_to_argb32(capture->buf, capture->width, capture->height,
+                               capture->stride, capture->format)) {
+    finish_capture(capture, HYPRLAND_CAPTURE_NO_CONVERSION);
+    return;
   }
+
+  capture->hash = pixel_hash(capture->buf, capture->width, capture->height,
+                             capture->stride);
+  finish_capture(capture, HYPRLAND_CAPTURE_READY);
+}
+
+/* Called when the compositor couldn't copy the export_frame, e.g. because the
+ * window was being resized. */
+void handle_hyprland_toplevel_export_frame_failed(
+    void *data,
+    struct hyprland_toplevel_export_frame_v1 *hyprland_toplevel_export_frame) {
+  struct hyprland_capture *capture = data;
+  telemetry_mark(&capture->telemetry, TELEMETRY_STAGE_FAILED);
+  finish_capture(capture, HYPRLAND_CAPTURE_FAILED);
 }
 
 #pragma GCC diagnostic push
@@ -232,11 +330,193 @@ const struct hyprland_toplevel_export_frame_v1_listener
         .damage = (void *)noop,
         .flags = (void *)noop,
         .ready = handle_hyprland_toplevel_export_frame_ready,
-        .failed = (void *)noop,
+        .failed = handle_hyprland_toplevel_export_frame_failed,
         .linux_dmabuf = (void *)noop,
         .buffer_done = handle_hyprland_toplevel_export_frame_buffer_done,
 };
 #pragma GCC diagnostic pop
+
+/* Called on the capture thread. The export frame is created through a wrapper
+ * so that its events are dispatched there as well. */
+static void start_capture(struct capture_item *item) {
+  struct hyprland_capture *capture = wl_container_of(item, capture, item);
+  struct peekaboo *peekaboo = capture->wm_client->peekaboo;
+  struct hyprland_client *hyprland_client = capture->wm_client->client;
+
+  struct hyprland_toplevel_export_manager_v1 *manager = capture_thread_wrap(
+      &peekaboo->capture_thread, peekaboo->hyprland_toplevel_export_manager);
+  capture->frame = hyprland_toplevel_export_manager_v1_capture_toplevel(
+      manager, 0, hyprland_client->address);
+  wl_proxy_wrapper_destroy(manager);
+  hyprland_toplevel_export_frame_v1_add_listener(
+      capture->frame, &hyprland_toplevel_export_frame_listener, capture);
+}
+
+/* Swaps the finished capture in for the one currently on screen. */
+static void show_capture(struct peekaboo *peekaboo,
+                         struct wm_client *wm_client,
+                         struct hyprland_capture *capture) {
+  wm_client->width = capture->width;
+  wm_client->height = capture->height;
+  wm_client->stride = capture->stride;
+  wm_client->format = capture->format;
+  /* Marks from here on, e.g. when it's first scaled, go to this capture. */
+  wm_client->telemetry = capture->telemetry;
+
+  /* Most windows don't change between captures. When the pixels are the
+   * same, keep the surfaces we already scaled instead of redoing the most
+   * expensive part of a render. */
+  bool unchanged =
+      wm_client->surface_cache != NULL &&
+      wm_client->capture_hash == capture->hash &&
+      wm_client->surface_cache->source_width == (int)wm_client->width &&
+      wm_client->surface_cache->source_height == (int)wm_client->height;
+  wm_client->capture_hash = capture->hash;
+
+  if (wm_client->surface_cache && !unchanged) {
+    surface_cache_destroy(wm_client->surface_cache);
+    wm_client->surface_cache = NULL;
+  }
+  if (wm_client->orig_surface) {
+    cairo_surface_destroy(wm_client->orig_surface);
+  }
+  wm_client->orig_surface = cairo_image_surface_create_for_data(
+      capture->buf, CAIRO_FORMAT_ARGB32, wm_client->width, wm_client->height,
+      wm_client->stride);
+  struct capture_mapping *mapping = malloc(sizeof(struct capture_mapping));
+  mapping->data = capture->buf;
+  mapping->size = wm_client->height * wm_client->stride;
+  cairo_surface_set_user_data(wm_client->orig_surface, &capture_mapping_key,
+                              mapping, unmap_capture);
+  capture->buf = NULL;
+
+  if (capture->preview_wl_buffer != NULL) {
+    if (wm_client->preview_wl_buffer != NULL) {
+      wl_buffer_destroy(wm_client->preview_wl_buffer);
+    }
+    wm_client->preview_wl_buffer = capture->preview_wl_buffer;
+    capture->preview_wl_buffer = NULL;
+    wm_client->preview_attached = false;
+  }
+
+  if (unchanged) {
+    log_debug("Capture of %s is unchanged, keeping scaled surfaces\n",
+              wm_client->title);
+    surface_cache_replace_source(wm_client->surface_cache,
+                                 wm_client->orig_surface);
+  } else {
+    /* With subsurface previews, the compositor does the scaling, and we'll
+     * only need to scale the capture for the disk cache. */
+    wm_client->surface_cache = surface_cache_init(
+        wm_client->orig_surface, &peekaboo->surface_cache_budget,
+        peekaboo->worker_pool.num_threads > 0 && !peekaboo->subsurface_previews
+            ? &peekaboo->worker_pool
+            : NULL,
+        handle_client_scaled, wm_client);
+  }
+  wm_client->ready = true;
+
+  /* Get a head start on scaling for where the client was last shown. */
+  if (!peekaboo->subsurface_previews &&
+      wm_client->preview_thumbnail_width > 0 &&
+      wm_client->preview_thumbnail_height > 0) {
+    surface_cache_request_scaled(wm_client->surface_cache,
+                                 wm_client->preview_thumbnail_width,
+                                 wm_client->preview_thumbnail_height, false);
+  }
+
+  peekaboo->request_frame(peekaboo);
+}
+
+/* A failed capture is tried again a few times with an increasing delay
+ * before giving up on the client. */
+static void retry_capture(struct peekaboo *peekaboo,
+                          struct wm_client *wm_client) {
+  if (wm_client->capture_attempts >= HYPRLAND_CAPTURE_MAX_ATTEMPTS) {
+    log_warning("Giving up capturing %s\n", wm_client->title);
+    telemetry_failure(TELEMETRY_FAILURE_GAVE_UP);
+    wm_client->capture_failed = true;
+    peekaboo->request_frame(peekaboo);
+    return;
+  }
+
+  uint32_t backoff_ms = HYPRLAND_CAPTURE_RETRY_BASE_MS
+                        << (wm_client->capture_attempts - 1);
+  log_debug("Capturing %s failed, retrying in %ums\n", wm_client->title,
+            backoff_ms);
+  event_loop_timer_arm(&peekaboo->event_loop, &wm_client->capture_retry_timer,
+                       backoff_ms);
+}
+
+/* Called on the main thread with whatever the capture thread made of the
+ * capture. */
+static void handle_capture_done(struct capture_item *item) {
+  struct hyprland_capture *capture = wl_container_of(item, capture, item);
+  struct wm_client *wm_client = capture->wm_client;
+  struct peekaboo *peekaboo = wm_client->peekaboo;
+  struct hyprland_client *hyprland_client = wm_client->client;
+  hyprland_client->capture = NULL;
+
+  if (item->cancelled) {
+    free_capture(capture);
+    return;
+  }
+
+  switch (capture->result) {
+  case HYPRLAND_CAPTURE_READY:
+    show_capture(peekaboo, wm_client, capture);
+    break;
+  case HYPRLAND_CAPTURE_FAILED:
+    telemetry_failure(TELEMETRY_FAILURE_COPY);
+    retry_capture(peekaboo, wm_client);
+    break;
+  case HYPRLAND_CAPTURE_NO_FORMAT:
+    log_warning("No supported buffer format offered for %s\n",
+                wm_client->title);
+    telemetry_failure(TELEMETRY_FAILURE_FORMAT);
+    /* Retrying won't make the compositor offer anything else. */
+    wm_client->capture_failed = true;
+    peekaboo->request_frame(peekaboo);
+    break;
+  case HYPRLAND_CAPTURE_NO_MEMORY:
+    log_error("Failed to allocate a buffer to capture %s into\n",
+              wm_client->title);
+    telemetry_failure(TELEMETRY_FAILURE_ALLOC);
+    /* Memory may well be there again in a moment. */
+    retry_capture(peekaboo, wm_client);
+    break;
+  case HYPRLAND_CAPTURE_NO_CONVERSION:
+    log_error("Cannot convert buffer format 0x%x\n", capture->format);
+    /* The compositor will offer the same format next time. */
+    wm_client->capture_failed = true;
+    peekaboo->request_frame(peekaboo);
+    break;
+  }
+  free_capture(capture);
+}
+
+/* Hand the client over to the capture thread, which creates an export frame
+ * for it and listens on the export frame for its buffer. */
+static void hyprland_client_capture(struct peekaboo *peekaboo,
+                                    struct wm_client *wm_client) {
+  struct hyprland_client *hyprland_client = wm_client->client;
+  /* The capture already on its way is as fresh as a new one would be. */
+  if (hyprland_client->capture) {
+    return;
+  }
+
+  wm_client->capture_attempts++;
+  struct hyprland_capture *capture = calloc(1, sizeof(struct hyprland_capture));
+  capture->wm_client = wm_client;
+  telemetry_capture_requested(&capture->telemetry);
+  hyprland_client->capture = capture;
+  capture_thread_submit(&peekaboo->capture_thread, &capture->item,
+                        start_capture, handle_capture_done);
+}
+static void handle_capture_retry_timer(void *data) {
+  struct wm_client *wm_client = data;
+  hyprland_client_capture(wm_client->peekaboo, wm_client);
+}
 // }}}
 
 static const char character_pool[] = {'f', 'j', 'd', 'k', 's', 'l', 'a', ';'};
@@ -303,15 +583,9 @@ void hyprland_clients_init(struct peekaboo *peekaboo,
 
       hyprland_client_entry = hyprland_client_entry->next;
     }
-    /* Create an export frame for the client and listen on the export
-     * frame for their buffer. */
-    hyprland_client->toplevel_export_frame =
-        hyprland_toplevel_export_manager_v1_capture_toplevel(
-            peekaboo->hyprland_toplevel_export_manager, 0,
-            hyprland_client->address);
-    hyprland_toplevel_export_frame_v1_add_listener(
-        hyprland_client->toplevel_export_frame,
-        &hyprland_toplevel_export_frame_listener, peekaboo);
+    event_loop_timer_init(&wm_client->capture_retry_timer,
+                          handle_capture_retry_timer, wm_client);
+    hyprland_client_capture(peekaboo, wm_client);
 
     wl_list_insert(wm_clients, &wm_client->link);
     client = client->next;
@@ -336,32 +610,32 @@ void hyprland_clients_init(struct peekaboo *peekaboo,
 void hyprland_clients_refresh(struct peekaboo *peekaboo,
                               struct wl_list *wm_clients) {
   struct wm_client *wm_client;
-  struct hyprland_client *hyprland_client;
   wl_list_for_each(wm_client, wm_clients, link) {
-    hyprland_client = wm_client->client;
-    if (hyprland_client->toplevel_export_frame) {
-      hyprland_toplevel_export_frame_v1_destroy(
-          hyprland_client->toplevel_export_frame);
-    }
-
-    hyprland_client->toplevel_export_frame =
-        hyprland_toplevel_export_manager_v1_capture_toplevel(
-            peekaboo->hyprland_toplevel_export_manager, 0,
-            hyprland_client->address);
-    hyprland_toplevel_export_frame_v1_add_listener(
-        hyprland_client->toplevel_export_frame,
-        &hyprland_toplevel_export_frame_listener, peekaboo);
+    event_loop_timer_disarm(&wm_client->capture_retry_timer);
+    wm_client->capture_attempts = 0;
+    wm_client->capture_failed = false;
+    hyprland_client_capture(peekaboo, wm_client);
   }
 }
 
 void hyprland_clients_destroy(struct wl_list *wm_clients) {
   struct wm_client *wm_client;
   struct wm_client *tmp;
-  struct hyprland_client *hyprland_client;
+  /* Captures still on their way were cancelled along with the capture
+   * thread. */
   wl_list_for_each_safe(wm_client, tmp, wm_clients, link) {
-    hyprland_client = wm_client->client;
-    if (wm_client->wl_buffer) {
-      wl_buffer_destroy(wm_client->wl_buffer);
+    event_loop_timer_disarm(&wm_client->capture_retry_timer);
+    if (wm_client->preview_wp_viewport) {
+      wp_viewport_destroy(wm_client->preview_wp_viewport);
+    }
+    if (wm_client->preview_wl_subsurface) {
+      wl_subsurface_destroy(wm_client->preview_wl_subsurface);
+    }
+    if (wm_client->preview_wl_surface) {
+      wl_surface_destroy(wm_client->preview_wl_surface);
+    }
+    if (wm_client->preview_wl_buffer) {
+      wl_buffer_destroy(wm_client->preview_wl_buffer);
     }
     if (wm_client->surface_cache) {
       surface_cache_destroy(wm_client->surface_cache);
@@ -369,13 +643,11 @@ void hyprland_clients_destroy(struct wl_list *wm_clients) {
     if (wm_client->orig_surface) {
       cairo_surface_destroy(wm_client->orig_surface);
     }
-    if (wm_client->buf) {
-      munmap(wm_client->buf, wm_client->height * wm_client->stride);
-    }
-    if (hyprland_client->toplevel_export_frame) {
-      hyprland_toplevel_export_frame_v1_destroy(
-          hyprland_client->toplevel_export_frame);
+    if (wm_client->disk_thumbnail) {
+      cairo_surface_destroy(wm_client->disk_thumbnail);
     }
+    text_layout_destroy(&wm_client->title_layout);
+    text_layout_destroy(&wm_client->shortcut_keys_layout);
 
     memset(wm_client->client, 0, sizeof(struct hyprland_client));
     free(wm_client->client);
@@ -398,3 +670,8 @@ void hyprland_client_focus(struct wm_client *wm_client) {
   }
   free(response);
 }
+
+uint64_t hyprland_client_id(struct wm_client *wm_client) {
+  struct hyprland_client *hyprland_client = wm_client->client;
+  return hyprland_client->address;
+}
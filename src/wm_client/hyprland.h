@@ -7,8 +7,9 @@
 #include <stdint.h>
 
 struct hyprland_client {
-  uint64_t                                 address;
-  struct hyprland_toplevel_export_frame_v1 *toplevel_export_frame;
+  uint64_t                address;
+  /* The capture on its way, if any. */
+  struct hyprland_capture *capture;
 };
 
 void hyprland_clients_init(struct peekaboo *peekaboo,
@@ -21,4 +22,6 @@ void hyprland_clients_destroy(struct wl_list *wm_clients);
 
 void hyprland_client_focus(struct wm_client *wm_client);
 
+uint64_t hyprland_client_id(struct wm_client *wm_client);
+
 #endif /* _WM_CLIENT__HYPRLAND_H_ */
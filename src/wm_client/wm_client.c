@@ -1,6 +1,8 @@
 #include "wm_client.h"
 #include "../log.h"
+#include "../thumbnail_cache.h"
 #include "hyprland.h"
+#include <stdlib.h>
 
 /*
  * Currently, only hyprland is supported. To support another WM, the following
@@ -70,3 +72,38 @@ void wm_client_focus(struct wm_client *wm_client) {
     break;
   }
 }
+
+uint64_t wm_client_id(struct wm_client *wm_client) {
+  switch (wm_client->wm_client_type) {
+  case WM_CLIENT_HYPRLAND:
+    return hyprland_client_id(wm_client);
+  default:
+    log_error("Unknown client type\n");
+    return 0;
+  }
+}
+
+void wm_clients_store_thumbnails(struct wl_list *wm_clients) {
+  size_t num_clients = wl_list_length(wm_clients);
+  uint64_t *client_ids = calloc(num_clients, sizeof(uint64_t));
+  size_t i = 0;
+
+  struct wm_client *wm_client;
+  wl_list_for_each(wm_client, wm_clients, link) {
+    client_ids[i++] = wm_client_id(wm_client);
+    if (!wm_client->ready || wm_client->preview_box_width == 0 ||
+        wm_client->preview_box_height == 0) {
+      continue;
+    }
+
+    /* This was drawn in the last frame, so it's a cache hit. */
+    cairo_surface_t *thumbnail = surface_cache_get_scaled(
+        wm_client->surface_cache, wm_client->preview_thumbnail_width,
+        wm_client->preview_thumbnail_height);
+    thumbnail_cache_store(client_ids[i - 1], wm_client->preview_box_width,
+                          wm_client->preview_box_height, thumbnail);
+  }
+
+  thumbnail_cache_collect_garbage(client_ids, num_clients);
+  free(client_ids);
+}
@@ -1,16 +1,28 @@
 #ifndef _WM_CLIENT__WM_CLIENT_H_
 #define _WM_CLIENT__WM_CLIENT_H_
 
+#include "../event_loop.h"
 #include "../surface.h"
+#include "../telemetry.h"
+#include "../text_layout.h"
 #include <cairo.h>
 #include <stdint.h>
 #include <wayland-util.h>
 
 #define WM_CLIENT_MAX_TITLE_LENGTH 512
 #define WM_CLIENT_MAX_SHORTCUT_KEYS_LENGTH 512
+#define WM_CLIENT_MAX_BUFFER_OFFERS 16
 
 enum WM_CLIENT { WM_CLIENT_HYPRLAND };
 
+/* A set of buffer parameters the WM is willing to capture the client into. */
+struct wm_client_buffer_offer {
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+};
+
 struct wm_client {
   struct wl_list       link;
   struct peekaboo      *peekaboo;
@@ -20,9 +32,10 @@ struct wm_client {
   void                 *client;
 
   char                 title[WM_CLIENT_MAX_TITLE_LENGTH];
+  /* The title and shortcut as last drawn, see text_layout.h. */
+  struct text_layout   title_layout;
+  struct text_layout   shortcut_keys_layout;
 
-  struct wl_buffer     *wl_buffer;
-  void                 *buf;
   cairo_surface_t      *orig_surface;
   struct surface_cache *surface_cache;
 
@@ -30,8 +43,39 @@ struct wm_client {
   uint32_t             height;
   uint32_t             stride;
   uint32_t             format;
+  /* pixel_hash() of the last capture, to skip rescaling when it's unchanged. */
+  uint64_t             capture_hash;
 
   bool                 ready;
+
+  /* Failed captures are retried with a backoff, up to a limit after which we
+   * give up and leave the placeholder in place. */
+  uint32_t                capture_attempts;
+  struct event_loop_timer capture_retry_timer;
+  bool                    capture_failed;
+
+  /* Timestamps of the capture on screen, see telemetry.h. */
+  struct telemetry_capture telemetry;
+
+  /* Thumbnail left on disk by a previous launch, shown until we're ready. It
+   * was looked up for a preview box of disk_thumbnail_box_{width,height}. */
+  cairo_surface_t      *disk_thumbnail;
+  uint32_t             disk_thumbnail_box_width;
+  uint32_t             disk_thumbnail_box_height;
+  /* Where the capture was last previewed, so we can write it back to disk. */
+  uint32_t             preview_box_width;
+  uint32_t             preview_box_height;
+  int                  preview_thumbnail_width;
+  int                  preview_thumbnail_height;
+
+  /* With subsurface previews, the capture as is, in ARGB8888 once converted,
+   * and the subsurface it's shown in, scaled by the compositor. */
+  struct wl_buffer     *preview_wl_buffer;
+  struct wl_surface    *preview_wl_surface;
+  struct wl_subsurface *preview_wl_subsurface;
+  struct wp_viewport   *preview_wp_viewport;
+  bool                 preview_attached;
+
   char                 shortcut_keys[WM_CLIENT_MAX_SHORTCUT_KEYS_LENGTH];
   uint32_t             shortcut_keys_highlight_len;
   bool                 hide;
@@ -48,4 +92,11 @@ void wm_clients_destroy(struct wl_list *wm_clients,
 
 void wm_client_focus(struct wm_client *wm_client);
 
+/* An id that identifies the same window across launches. */
+uint64_t wm_client_id(struct wm_client *wm_client);
+
+/* Writes the last thumbnail of every client to the on-disk thumbnail cache and
+ * drops the cached thumbnails of windows that no longer exist. */
+void wm_clients_store_thumbnails(struct wl_list *wm_clients);
+
 #endif /* _WM_CLIENT__WM_CLIENT_H_ */
@@ -0,0 +1,148 @@
+#include "worker_pool.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void *worker_main(void *data) {
+  struct worker_pool *pool = data;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (!pool->stopping && wl_list_empty(&pool->pending)) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+
+    struct worker_job *job = wl_container_of(pool->pending.next, job, link);
+    wl_list_remove(&job->link);
+    pthread_mutex_unlock(&pool->lock);
+
+    job->run(job);
+    job->ran = true;
+
+    pthread_mutex_lock(&pool->lock);
+    wl_list_insert(pool->finished.prev, &job->link);
+    uint64_t one = 1;
+    if (write(pool->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      log_error("Failed to signal finished job: %s\n", strerror(errno));
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* Runs `done` for everything the workers have finished so far. */
+static void handle_finished_jobs(void *data, int fd, uint32_t revents) {
+  struct worker_pool *pool = data;
+
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    log_error("Failed to read worker pool eventfd: %s\n", strerror(errno));
+  }
+
+  /* Take the whole list so `done` can submit new jobs without deadlocking. */
+  struct wl_list finished;
+  pthread_mutex_lock(&pool->lock);
+  wl_list_init(&finished);
+  wl_list_insert_list(&finished, &pool->finished);
+  wl_list_init(&pool->finished);
+  pthread_mutex_unlock(&pool->lock);
+
+  struct worker_job *job, *tmp;
+  wl_list_for_each_safe(job, tmp, &finished, link) {
+    wl_list_remove(&job->link);
+    job->done(job);
+  }
+}
+
+bool worker_pool_init(struct worker_pool *pool, struct event_loop *loop) {
+  memset(pool, 0, sizeof(struct worker_pool));
+  wl_list_init(&pool->pending);
+  wl_list_init(&pool->finished);
+  /* Before anything can fail, so worker_pool_destroy() works either way. */
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  pool->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool->event_fd < 0) {
+    log_error("Failed to create worker pool eventfd: %s\n", strerror(errno));
+    pool->event_fd = -1;
+    return false;
+  }
+  if (!event_loop_add_fd(loop, pool->event_fd, POLLIN, handle_finished_jobs,
+                         pool)) {
+    close(pool->event_fd);
+    pool->event_fd = -1;
+    return false;
+  }
+
+  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t num_threads = num_cores < 1 ? 1 : num_cores;
+  if (num_threads > WORKER_POOL_MAX_THREADS) {
+    num_threads = WORKER_POOL_MAX_THREADS;
+  }
+
+  /* Signals are for the main thread, where they interrupt poll(). Threads
+   * inherit the signal mask, so block everything while creating them. */
+  sigset_t all_signals, old_signals;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  for (uint32_t i = 0; i < num_threads; i++) {
+    if (pthread_create(&pool->threads[pool->num_threads], NULL, worker_main,
+                       pool) != 0) {
+      log_warning("Failed to create worker thread %u\n", i);
+      break;
+    }
+    pool->num_threads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+  log_debug("Started %u worker threads\n", pool->num_threads);
+  return pool->num_threads > 0;
+}
+
+void worker_pool_submit(struct worker_pool *pool, struct worker_job *job,
+                        worker_job_cb run, worker_job_cb done) {
+  job->run = run;
+  job->done = done;
+  job->ran = false;
+
+  pthread_mutex_lock(&pool->lock);
+  wl_list_insert(pool->pending.prev, &job->link);
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (uint32_t i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  struct worker_job *job, *tmp;
+  wl_list_for_each_safe(job, tmp, &pool->finished, link) {
+    wl_list_remove(&job->link);
+    job->done(job);
+  }
+  wl_list_for_each_safe(job, tmp, &pool->pending, link) {
+    wl_list_remove(&job->link);
+    job->done(job);
+  }
+
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  if (pool->event_fd >= 0) {
+    close(pool->event_fd);
+    pool->event_fd = -1;
+  }
+}
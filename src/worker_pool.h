@@ -0,0 +1,54 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include "event_loop.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+/* A fixed set of threads, one per core, to take heavy work (scaling,
+ * mostly) off the Wayland thread. Jobs run on whichever worker is free, and
+ * are handed back to the main thread through the event loop once done. */
+
+#define WORKER_POOL_MAX_THREADS 16
+
+struct worker_job;
+typedef void (*worker_job_cb)(struct worker_job *job);
+
+/* Meant to be embedded in a bigger struct describing the actual work. */
+struct worker_job {
+  struct wl_list link;
+  /* Called on a worker thread. */
+  worker_job_cb  run;
+  /* Called on the main thread after `run`, or without running it at all if
+   * the pool is torn down first. Should free the job. */
+  worker_job_cb  done;
+  bool           ran;
+};
+
+struct worker_pool {
+  pthread_t       threads[WORKER_POOL_MAX_THREADS];
+  uint32_t        num_threads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  struct wl_list  pending;
+  struct wl_list  finished;
+  bool            stopping;
+
+  /* Signalled whenever a job lands in `finished`. */
+  int             event_fd;
+};
+
+/* Returns false if no worker could be started, in which case nothing should
+ * be submitted. The pool must be destroyed either way. */
+bool worker_pool_init(struct worker_pool *pool, struct event_loop *loop);
+
+void worker_pool_submit(struct worker_pool *pool, struct worker_job *job,
+                        worker_job_cb run, worker_job_cb done);
+
+/* Waits for the running jobs, then calls `done` for every job left. */
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif /* _WORKER_POOL_H_ */